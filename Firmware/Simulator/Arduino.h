@@ -0,0 +1,67 @@
+//
+// Arduino.h - mock Arduino API for running the IOTA firmware on a desktop
+//
+// Only what iota.ino uses is declared here. Everything is implemented in
+// iotasim.cpp, which keeps a virtual clock instead of waiting.
+//
+
+#ifndef IOTASIM_ARDUINO_H
+#define IOTASIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define LOW 0
+#define HIGH 1
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define B00000010 0x02
+#define B11111101 0xfd
+
+// an 8 bit i/o port that tells the simulator when it changes
+class SimPort
+{
+public:
+  // pins[i] is the Arduino pin of bit i, or -1
+  SimPort(const signed char *pins) : pPins(pins), pValue(0) { }
+  SimPort &operator=(uint8_t v);
+  SimPort &operator&=(uint8_t v) { return *this = pValue & v; }
+  SimPort &operator|=(uint8_t v) { return *this = pValue | v; }
+  operator uint8_t() const { return pValue; }
+private:
+  const signed char *pPins;
+  uint8_t pValue;
+};
+
+extern SimPort PORTA, PORTC, PORTG, PORTL;
+
+// timer 1; the simulator calls the compare interrupt while the virtual clock runs
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, TCNT1;
+
+#define WGM12 3
+#define CS11 1
+#define OCIE1A 1
+#define OCF1A 1
+
+#define ISR(vector) void vector()
+void TIMER1_COMPA_vect();
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+int digitalRead(int pin);
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+void noInterrupts();
+void interrupts();
+char *ltoa(long value, char *buf, int radix);
+
+#endif
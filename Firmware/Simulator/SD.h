@@ -0,0 +1,42 @@
+//
+// SD.h - mock SD card library that reads files of the host
+//
+
+#ifndef IOTASIM_SD_H
+#define IOTASIM_SD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define FILE_READ 0
+
+class File
+{
+public:
+  File() : pFile(0L) { }
+  operator bool() const { return pFile!=0L; }
+  int read();
+  int read(void *buf, uint16_t n);
+  int available();
+  bool seek(uint32_t pos);
+  uint32_t position();
+  uint32_t size();
+  void close();
+  const char *name() { return ""; }
+  bool isDirectory() { return false; }
+  File openNextFile() { return File(); }
+  void rewindDirectory() { }
+  FILE *pFile;
+};
+
+class SDClass
+{
+public:
+  bool begin(int csPin);
+  File open(const char *name, int mode=FILE_READ);
+  void end();
+};
+
+extern SDClass SD;
+
+#endif
@@ -0,0 +1,35 @@
+//
+// SPI.h - mock SPI library; the SD card is simulated at file level, so only
+// the pins of the ink shift register are driven
+//
+
+#ifndef IOTASIM_SPI_H
+#define IOTASIM_SPI_H
+
+#include <stdint.h>
+
+extern uint8_t SPCR, SPSR;
+
+#define SPE 6
+#define DORD 5
+#define MSTR 4
+#define SPI2X 0
+
+#define SPI_CLOCK_DIV4 0x00
+#define SPI_CLOCK_DIV16 0x01
+#define SPI_CLOCK_DIV64 0x02
+#define SPI_CLOCK_DIV128 0x03
+#define SPI_CLOCK_DIV2 0x04
+#define SPI_CLOCK_DIV8 0x05
+#define SPI_CLOCK_DIV32 0x06
+
+class SPIClass
+{
+public:
+  void begin();
+  uint8_t transfer(uint8_t data);
+};
+
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,25 @@
+//
+// Wire.h - mock i2c bus with the LCD03 display and key pad of the IOTA
+//
+
+#ifndef IOTASIM_WIRE_H
+#define IOTASIM_WIRE_H
+
+#include <stdint.h>
+
+class TwoWire
+{
+public:
+  void begin();
+  void beginTransmission(int address);
+  int endTransmission();
+  int write(int c);
+  int write(const char *text);
+  int requestFrom(int address, int n);
+  int available();
+  int read();
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,534 @@
+//
+// iotasim.cpp - run the IOTA firmware on a desktop computer
+//
+// The firmware is compiled unchanged against the mock Arduino headers in
+// this directory. Pins, ports, the i2c display and the SD card are
+// simulated, and every delay advances a virtual clock instead of waiting.
+// The firmware marks its hot paths with IOTA_CYCLES, so computation costs
+// time as well. Every port write is simulated, and the ink shots write the
+// ports so often that a print runs only about 600 to 800 times faster than
+// on the machine; two hours of printing take 10 to 15 seconds.
+//
+// usage: iotasim [-l startLayer] file.3dp
+//
+
+#include <stdint.h>
+
+// charge the virtual clock for code that runs on the 16 MHz AVR
+static inline void simAdvanceCycles(uint64_t cycles);
+#define IOTA_CYCLES(n) simAdvanceCycles(n)
+
+#include "../iota.ino"
+
+#include <stdio.h>
+#include <chrono>
+
+
+// ================ simulated hardware
+
+// ---------------- timing, all in microseconds
+
+const double kSimDigitalWriteTime = 4.0;   // digitalWrite() on a 16MHz AVR
+const double kSimDigitalReadTime = 4.0;
+const double kSimPortWriteTime = 0.25;     // changing a bit of a port register directly
+const double kSimSPIByteTime = 0.5;        // starting a byte and waiting for it, plus 8 SPI clocks
+const double kSimI2CByteTime = 90.0;       // 9 bits at 100kHz
+const double kSimSDCallTime = 5.0;         // every call into the SD library
+const double kSimSDByteTime = 0.25;        // copying a byte out of the cache
+const double kSimSDBlockTime = 1000.0;     // reading a 512 byte block from the card
+
+// the clock counts cycles of the 16 MHz AVR; integer arithmetic keeps the
+// port writes that dominate a print cheap
+const double kSimCyclesPerUs = 16.0;
+uint64_t gSimCycles = 0;
+
+static inline double simTime()
+{
+  return gSimCycles/kSimCyclesPerUs;
+}
+
+// ---------------- timer 1
+
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, TCNT1;
+
+bool gSimInterrupts = true, gSimInISR = false, gSimTimerArmed = false;
+uint64_t gSimTimerNext = 0;
+
+// cycles between two compare interrupts in CTC mode
+static uint64_t simTimerPeriod()
+{
+  static const unsigned prescale[] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+  return (OCR1A+1)*(uint64_t)prescale[TCCR1B&7];
+}
+
+// call the timer interrupts that are due until the clock reaches end
+static void __attribute__((noinline)) simRunTimer(uint64_t end)
+{
+  for (;;) {
+    if (gSimInISR) break;
+    bool armed = (TIMSK1 & (1<<OCIE1A)) && (TCCR1B & 7);
+    if (armed && !gSimTimerArmed)
+      gSimTimerNext = gSimCycles + simTimerPeriod();
+    gSimTimerArmed = armed;
+    if (!armed || !gSimInterrupts || gSimTimerNext>end) break;
+    if (gSimTimerNext>gSimCycles) gSimCycles = gSimTimerNext;
+    uint64_t t = gSimCycles;
+    gSimInISR = true;
+    TIMER1_COMPA_vect();
+    gSimInISR = false;
+    end += gSimCycles - t;
+    gSimTimerNext += simTimerPeriod();
+  }
+  gSimCycles = end;
+}
+
+// advance the virtual clock and call the timer interrupt whenever it is due;
+// time spent in the interrupt delays whatever was interrupted
+static inline void simAdvanceCycles(uint64_t cycles)
+{
+  uint64_t end = gSimCycles + cycles;
+  // most calls come from pin writes between two timer interrupts; they
+  // only need the checks that end the loop in simRunTimer() right away
+  bool armed = (TIMSK1 & (1<<OCIE1A)) && (TCCR1B & 7);
+  if (   gSimInISR
+      || (armed==gSimTimerArmed && (!armed || !gSimInterrupts || gSimTimerNext>end))) {
+    gSimCycles = end;
+    return;
+  }
+  simRunTimer(end);
+}
+
+static inline void simAdvance(double us)
+{
+  simAdvanceCycles((uint64_t)(us*kSimCyclesPerUs + 0.5));
+}
+
+// ---------------- pins and axes
+
+struct SimAxis
+{
+  const char *name;
+  int stepPin, dirPin, incrementDir;
+  long position, steps;
+};
+
+SimAxis gSimAxis[] = {
+  { "X",  stepperXStepPin,  stepperXDirPin,  0, 1000,   0 },
+  { "Y",  stepperYStepPin,  stepperYDirPin,  1, 10000,  0 },
+  { "Z1", stepperZ1StepPin, stepperZ1DirPin, 0, 100000, 0 },
+  { "Z2", stepperZ2StepPin, stepperZ2DirPin, 1, 100000, 0 },
+  { "R",  stepperRStepPin,  stepperRDirPin,  1, 0,      0 },
+};
+const int kSimNAxis = sizeof(gSimAxis)/sizeof(SimAxis);
+
+const int kSimNPins = 70;
+uint8_t gSimPin[kSimNPins];
+SimAxis *gSimStepPin[kSimNPins];
+uint64_t gSimLastStepCycles = 0;
+
+// ---------------- ink cartridge
+
+const int kSimNozzles = 12;                // outputs 12 to 15 are not connected
+uint16_t gSimInkShift = 0, gSimInkLatch = 0;
+long gSimNozzleFired[16];
+long gSimInkPulses = 0;
+uint32_t gSimInkHash = 2166136261u;        // FNV-1a over every clock, strobe and fire
+
+static void simInkEvent(int event)
+{
+  gSimInkHash = (gSimInkHash ^ event) * 16777619u;
+}
+
+// a pin changed its level
+static void simPinChanged(int pin, int value)
+{
+  SimAxis *a = gSimStepPin[pin];
+  if (a) {
+    if (value) {
+      // rising edge on a step pin
+      a->position += (gSimPin[a->dirPin]==a->incrementDir) ? 1 : -1;
+      a->steps++;
+      gSimLastStepCycles = gSimCycles;
+    }
+  } else if (pin==inkClockPin) {
+    if (value) {
+      gSimInkShift = (gSimInkShift<<1) | gSimPin[inkDataPin];
+      simInkEvent(gSimPin[inkDataPin]);
+    }
+  } else if (pin==inkStrobePin) {
+    if (value) {
+      gSimInkLatch = gSimInkShift;
+      simInkEvent(2);
+    }
+  } else if (pin==inkEnablePin) {
+    if (!value) {
+      simInkEvent(3);
+      // the enable line is active low and fires all latched nozzles
+      int i;
+      for (i=0; i<16; i++) {
+        if (gSimInkLatch & (1<<i)) gSimNozzleFired[i]++;
+      }
+      gSimInkPulses++;
+    }
+  }
+}
+
+static inline void simSetPin(int pin, int value)
+{
+  value = value ? 1 : 0;
+  if (pin<0 || pin>=kSimNPins || gSimPin[pin]==value) return;
+  gSimPin[pin] = value;
+  simPinChanged(pin, value);
+}
+
+// ---------------- Arduino API
+
+// the Arduino pins on the ports of the Mega 2560
+static const signed char kSimPortA[] = { 22, 23, 24, 25, 26, 27, 28, 29 };
+static const signed char kSimPortC[] = { 37, 36, 35, 34, 33, 32, 31, 30 };
+static const signed char kSimPortG[] = { 41, 40, 39, -1, -1, 4, -1, -1 };
+static const signed char kSimPortL[] = { 49, 48, 47, 46, 45, 44, 43, 42 };
+
+SimPort PORTA(kSimPortA), PORTC(kSimPortC), PORTG(kSimPortG), PORTL(kSimPortL);
+
+inline SimPort &SimPort::operator=(uint8_t v)
+{
+  simAdvance(kSimPortWriteTime);
+  unsigned changed = pValue ^ v;
+  pValue = v;
+  // only visit the bits that changed
+  while (changed) {
+    int i = __builtin_ctz(changed);
+    changed &= changed-1;
+    if (pPins[i]>=0) simSetPin(pPins[i], (v>>i)&1);
+  }
+  return *this;
+}
+
+void pinMode(int, int)
+{
+}
+
+void digitalWrite(int pin, int value)
+{
+  simAdvance(kSimDigitalWriteTime);
+  simSetPin(pin, value);
+}
+
+int digitalRead(int pin)
+{
+  simAdvance(kSimDigitalReadTime);
+  // endstops close at position 0; both Z axes share one input
+  if (pin==stepperXEndstopPin) return gSimAxis[0].position<=0;
+  if (pin==stepperYEndstopPin) return gSimAxis[1].position<=0;
+  if (pin==stepperZ1EndstopPin) return gSimAxis[2].position<=0 || gSimAxis[3].position<=0;
+  if (pin>=0 && pin<kSimNPins) return gSimPin[pin];
+  return 0;
+}
+
+void delay(unsigned long ms)
+{
+  simAdvance(ms*1000.0);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  simAdvance(us);
+}
+
+unsigned long millis()
+{
+  return (unsigned long)(simTime()/1000.0);
+}
+
+unsigned long micros()
+{
+  return (unsigned long)simTime();
+}
+
+void noInterrupts()
+{
+  gSimInterrupts = false;
+}
+
+void interrupts()
+{
+  gSimInterrupts = true;
+  simAdvance(0.0);
+}
+
+char *ltoa(long value, char *buf, int radix)
+{
+  // an AVR long has 32 bits
+  int32_t v = (int32_t)value;
+  if (radix==16)
+    sprintf(buf, "%x", (unsigned)v);
+  else
+    sprintf(buf, "%d", v);
+  return buf;
+}
+
+// ---------------- SPI
+
+const int kSimMOSIPin = 51, kSimSCKPin = 52;
+
+uint8_t SPCR, SPSR;
+SPIClass SPI;
+
+void SPIClass::begin()
+{
+  SPCR |= (1<<MSTR) | (1<<SPE);
+}
+
+// shift a byte out in mode 0: MOSI changes while SCK is low, and is read on the rising edge
+uint8_t SPIClass::transfer(uint8_t data)
+{
+  static const int divider[] = { 4, 16, 64, 128, 2, 8, 32, 64 };
+  simAdvanceCycles(kSimSPIByteTime*kSimCyclesPerUs + 8*divider[(SPCR&3) | ((SPSR&1)<<2)]);
+  int i;
+  for (i=0; i<8; i++) {
+    int bit = (SPCR & (1<<DORD)) ? i : 7-i;
+    simSetPin(kSimMOSIPin, (data>>bit)&1);
+    simSetPin(kSimSCKPin, 1);
+    simSetPin(kSimSCKPin, 0);
+  }
+  return 0;
+}
+
+// ---------------- LCD03 display and key pad
+
+TwoWire Wire;
+
+char gSimDisplay[4][21];
+int gSimDisplayRow = 0, gSimDisplayCol = 0;
+int gSimWireRegister = -1, gSimWireArg = 0, gSimWireCmd = 0;
+int gSimKeyRead = 0, gSimKeys = 0;
+uint64_t gSimLastKeyPress = 0;
+
+void TwoWire::begin()
+{
+  memset(gSimDisplay, ' ', sizeof(gSimDisplay));
+  int i;
+  for (i=0; i<4; i++) gSimDisplay[i][20] = 0;
+}
+
+void TwoWire::beginTransmission(int)
+{
+  simAdvance(kSimI2CByteTime);
+  gSimWireRegister = -1;
+  gSimWireArg = 0;
+}
+
+int TwoWire::endTransmission()
+{
+  return 0;
+}
+
+int TwoWire::write(int c)
+{
+  simAdvance(kSimI2CByteTime);
+  c &= 0xff;
+  if (gSimWireRegister==-1) {
+    gSimWireRegister = c;
+    gSimKeyRead = c;
+    return 1;
+  }
+  if (gSimWireRegister!=0) return 1;
+  if (gSimWireArg) {
+    // arguments of the set cursor command
+    if (gSimWireArg==2) gSimDisplayRow = (c-1)&3;
+    else gSimDisplayCol = c-1;
+    gSimWireArg--;
+    return 1;
+  }
+  switch (c) {
+    case 1: gSimDisplayRow = gSimDisplayCol = 0; break;
+    case 3: gSimWireArg = 2; break;
+    case 12:
+      memset(gSimDisplay, ' ', sizeof(gSimDisplay));
+      for (int i=0; i<4; i++) gSimDisplay[i][20] = 0;
+      gSimDisplayRow = gSimDisplayCol = 0;
+      break;
+    default:
+      if (c>=32 && gSimDisplayCol>=0 && gSimDisplayCol<20)
+        gSimDisplay[gSimDisplayRow][gSimDisplayCol++] = (c<127) ? c : '#';
+      break;
+  }
+  return 1;
+}
+
+int TwoWire::write(const char *text)
+{
+  int n = 0;
+  while (*text) n += write(*text++);
+  return n;
+}
+
+int TwoWire::requestFrom(int, int n)
+{
+  simAdvance((n+1)*kSimI2CByteTime);
+  // if the firmware waits for a key for ten seconds without moving
+  // anything, someone presses [Back]
+  if (gSimKeyRead==1) {
+    gSimKeys = 0;
+    if (gSimCycles-gSimLastStepCycles>10e6*kSimCyclesPerUs && gSimCycles-gSimLastKeyPress>10e6*kSimCyclesPerUs) {
+      gSimKeys = kKeyBack;
+      gSimLastKeyPress = gSimCycles;
+    }
+  }
+  return n;
+}
+
+int TwoWire::available()
+{
+  return 1;
+}
+
+int TwoWire::read()
+{
+  return (gSimKeyRead==1) ? (gSimKeys>>8) : (gSimKeys&0xff);
+}
+
+// ---------------- SD card
+
+SDClass SD;
+
+long gSimSDCalls = 0, gSimSDBlocks = 0;
+long gSimSDBlock = -1;
+
+// charge the time for reading bytes at the current position
+static void simSDRead(FILE *f, long n)
+{
+  long pos = ftell(f);
+  long b;
+  gSimSDCalls++;
+  simAdvance(kSimSDCallTime + n*kSimSDByteTime);
+  for (b=pos/512; b<=(pos+n-1)/512; b++) {
+    if (b!=gSimSDBlock) {
+      gSimSDBlock = b;
+      gSimSDBlocks++;
+      simAdvance(kSimSDBlockTime);
+    }
+  }
+}
+
+int File::read()
+{
+  simSDRead(pFile, 1);
+  return fgetc(pFile);
+}
+
+int File::read(void *buf, uint16_t n)
+{
+  simSDRead(pFile, n);
+  return (int)fread(buf, 1, n, pFile);
+}
+
+int File::available()
+{
+  simAdvance(kSimSDCallTime);
+  return (int)(size()-position());
+}
+
+bool File::seek(uint32_t pos)
+{
+  simAdvance(kSimSDCallTime);
+  return pos<=size() && fseek(pFile, pos, SEEK_SET)==0;
+}
+
+uint32_t File::position()
+{
+  return (uint32_t)ftell(pFile);
+}
+
+uint32_t File::size()
+{
+  long pos = ftell(pFile);
+  fseek(pFile, 0, SEEK_END);
+  long n = ftell(pFile);
+  fseek(pFile, pos, SEEK_SET);
+  return (uint32_t)n;
+}
+
+void File::close()
+{
+  if (pFile) fclose(pFile);
+  pFile = 0L;
+}
+
+bool SDClass::begin(int)
+{
+  return true;
+}
+
+File SDClass::open(const char *name, int)
+{
+  File f;
+  f.pFile = fopen(name, "rb");
+  gSimSDBlock = -1;
+  return f;
+}
+
+void SDClass::end()
+{
+}
+
+
+// ================ main
+
+static void simPrintDisplay()
+{
+  int i;
+  printf("+--------------------+\n");
+  for (i=0; i<4; i++) printf("|%s|\n", gSimDisplay[i]);
+  printf("+--------------------+\n");
+}
+
+int main(int argc, char **argv)
+{
+  long startLayer = 1;
+  const char *name = 0L;
+  int i;
+  for (i=1; i<argc; i++) {
+    if (strcmp(argv[i], "-l")==0 && i+1<argc) {
+      startLayer = atol(argv[++i]);
+    } else if (!name) {
+      name = argv[i];
+    } else {
+      name = 0L;
+      break;
+    }
+  }
+  if (!name) {
+    fprintf(stderr, "usage: iotasim [-l startLayer] file.3dp\n");
+    return 1;
+  }
+  for (i=0; i<kSimNAxis; i++) gSimStepPin[gSimAxis[i].stepPin] = &gSimAxis[i];
+
+  setup();
+  displayClear();
+  double t0 = simTime();
+  std::chrono::steady_clock::time_point w0 = std::chrono::steady_clock::now();
+  interpreterRunFromSD(name, startLayer);
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now()-w0).count();
+  double t = (simTime()-t0)/1e6;
+
+  simPrintDisplay();
+  printf("print time  %12.1fs (%.2fh)\n", t, t/3600.0);
+  printf("simulated in%12.3fs (%.0fx real time)\n", wall, wall>0.0 ? t/wall : 0.0);
+  for (i=0; i<kSimNAxis; i++) {
+    printf("steps %-5s %12ld, now at %ld\n", gSimAxis[i].name, gSimAxis[i].steps, gSimAxis[i].position);
+  }
+  long fired = 0;
+  printf("nozzles    ");
+  for (i=0; i<kSimNozzles; i++) {
+    printf(" %ld", gSimNozzleFired[i]);
+    fired += gSimNozzleFired[i];
+  }
+  printf("\n");
+  printf("drops       %12ld of %ld pulses\n", fired, gSimInkPulses);
+  printf("ink signals     %08x\n", gSimInkHash);
+  printf("sd card     %12ld calls, %ld blocks\n", gSimSDCalls, gSimSDBlocks);
+  return 0;
+}
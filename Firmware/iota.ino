@@ -14,9 +14,11 @@ trick the Arduino software into putting prototypes here, or they will cause an e
 // -- globals
 // -- forwards
 // - hardware abstraction layer
+// -- fast pins
 // -- display
 // -- keys
 // -- beeper
+// -- step engine
 // -- steppers and endstops
 // -- motors
 // -- ink
@@ -37,6 +39,26 @@ trick the Arduino software into putting prototypes here, or they will cause an e
 #include <string.h>
 
 // ================ configuration
+
+// The nozzle shift register of the ink shield is wired to pins 46 (data) and
+// 47 (clock). Set this to 1 only on shields that have been rewired to the
+// hardware SPI port (MOSI on pin 51, SCK on pin 52) that the SD card uses too.
+#ifndef IOTA_INK_SPI
+#define IOTA_INK_SPI 0
+#endif
+
+// SPI clock for the shift register when IOTA_INK_SPI is 1; SPI_CLOCK_DIV8 is
+// 2MHz, which the cartridge cable has not been tested beyond
+#ifndef IOTA_INK_SPI_CLOCK
+#define IOTA_INK_SPI_CLOCK SPI_CLOCK_DIV8
+#endif
+
+// The desktop simulator defines this to charge its clock for the CPU cycles
+// that a piece of code takes on the AVR; on the printer it does nothing.
+#ifndef IOTA_CYCLES
+#define IOTA_CYCLES(n)
+#endif
+
 // ================ globals
 
 
@@ -56,6 +78,40 @@ void firmwareError(const char *line1, const char *line2="", const char *line3=""
 
 // ================ hardware abstraction layer
 
+// ---------------- fast pins
+
+// digitalWrite() looks up the port and bit of a pin at run time and takes a
+// few microseconds. FastPin<pin> knows both at compile time, so changing a
+// pin on ports A to G is a single sbi or cbi instruction. Port L is outside
+// the range of those instructions; its pins must not be changed from the
+// main loop while the step interrupt may change them too.
+template <int pin> struct FastPin;
+
+#define FAST_PIN(pin, port, bit) \
+  template <> struct FastPin<pin> { \
+    enum { mask = (1<<bit) }; \
+    static void high() { port |= mask; } \
+    static void low() { port &= (uint8_t)~mask; } \
+    static void write(uint8_t v) { if (v) high(); else low(); } \
+  };
+
+// the pins that we use on the Arduino Mega 2560
+FAST_PIN(28, PORTA, 6)
+FAST_PIN(29, PORTA, 7)
+FAST_PIN(32, PORTC, 5)
+FAST_PIN(33, PORTC, 4)
+FAST_PIN(36, PORTC, 1)
+FAST_PIN(37, PORTC, 0)
+FAST_PIN(40, PORTG, 1)
+FAST_PIN(41, PORTG, 0)
+FAST_PIN(44, PORTL, 5)
+FAST_PIN(45, PORTL, 4)
+FAST_PIN(46, PORTL, 3)
+FAST_PIN(47, PORTL, 2)
+FAST_PIN(48, PORTL, 1)
+FAST_PIN(49, PORTL, 0)
+
+
 // ---------------- display
 
 const int displayAddress = 0x63;
@@ -245,6 +301,176 @@ void setupBeeper()
 }
 
 
+// ---------------- step engine
+
+// Moves are queued and stepped by the timer 1 compare interrupt, so that the
+// interpreter can read and decode the next commands while an axis moves.
+// Queued moves run one after the other. Anything that needs the axes to be
+// in place, like firing ink or reading an endstop, calls stepperWait() first.
+// A move can step several axes at once: the axis that moves farthest gets a
+// step on every interrupt, and the others follow it in a Bresenham line.
+
+// Every move follows a trapezoid: it starts at a speed the motor can take
+// from standstill, speeds up at a constant rate to its full speed, and slows
+// down the same way at the end. Step intervals are found with the integer
+// recurrence from Atmel AVR446: c[n] = c[n-1] - 2*c[n-1]/(4n+1), where n
+// counts the steps of a ramp that started at zero speed. At an interval of
+// c microseconds, such a ramp is at step n = 10^12/(2*accel*c*c).
+struct StepperRamp
+{
+  long steps;                 // steps left in this move
+  long rampUp;                // steps left to speed up
+  long rampDown;              // steps at the end that slow down
+  unsigned int interval;      // microseconds to the next step
+  unsigned int minInterval, maxInterval;
+  unsigned int n;             // position on the ramp from zero speed
+  unsigned int rest;          // remainder of the last division
+
+  // set up a move of nSteps, starting and ending at startInterval; n0 and
+  // n1 are the ramp steps at startInterval and at fullInterval
+  void start(long nSteps, unsigned int startInterval, unsigned int fullInterval, long n0, long n1)
+  {
+    steps = nSteps;
+    interval = maxInterval = startInterval;
+    minInterval = fullInterval;
+    rest = 0;
+    if (n1>16000) n1 = 16000; // keep 4n+1 in 16 bits
+    long ramp = n1-n0, half = (nSteps-1)>>1;
+    if (ramp>half) ramp = half;
+    if (ramp<0) ramp = 0;
+    n = n0;
+    rampUp = rampDown = ramp;
+  }
+
+  // call after every step; returns the interval to the next step
+  unsigned int next()
+  {
+    steps--;
+    if (rampUp) {
+      IOTA_CYCLES(250);
+      rampUp--;
+      n++;
+      unsigned int d = 4*n+1, x = 2*interval+rest;
+      interval -= x/d;
+      rest = x%d;
+      if (interval<minInterval) interval = minInterval;
+    } else if (steps<=rampDown && steps>0) {
+      IOTA_CYCLES(250);
+      if (steps==rampDown) rest = 0;
+      unsigned int d = 4*n-1, x = 2*interval+rest;
+      interval += x/d;
+      rest = x%d;
+      n--;
+      if (interval>maxInterval) interval = maxInterval;
+    }
+    return interval;
+  }
+};
+
+const uint8_t kStepperMaxAxes = 5;
+
+// set the direction pins of some axes and pulse their step pins; bit i of
+// the masks is axis i in gStepperAxis
+void stepperSetDirections(uint8_t axes, uint8_t dir);
+void stepperPulse(uint8_t axes);
+
+struct StepperMove
+{
+  uint8_t nAxes;
+  uint8_t axes, dir;            // axes in this move and their direction pins as bit masks
+  uint8_t axis[kStepperMaxAxes];
+  long steps[kStepperMaxAxes];  // steps of every axis
+  long error[kStepperMaxAxes];  // Bresenham error of every axis
+  long major;                   // steps of the axis that moves farthest
+  StepperRamp ramp;             // times the steps of the major axis
+};
+
+const uint8_t kStepperQueueSize = 8;
+StepperMove gStepperQueue[kStepperQueueSize];
+volatile uint8_t gStepperQueueHead = 0;   // next free entry
+volatile uint8_t gStepperQueueTail = 0;   // the move that is being stepped
+volatile boolean gStepperRunning = false;
+
+// get ready to step the move at the tail of the queue; interrupts must be off
+void stepperLoadMove()
+{
+  StepperMove &m = gStepperQueue[gStepperQueueTail];
+  stepperSetDirections(m.axes, m.dir);
+  OCR1A = 2*m.ramp.interval-1;  // timer 1 counts at 2MHz
+}
+
+// called once per step of the major axis: pulse the step pins of all axes
+// that are due and time the next step
+ISR(TIMER1_COMPA_vect)
+{
+  StepperMove &m = gStepperQueue[gStepperQueueTail];
+  uint8_t i, stepped = 0;
+  IOTA_CYCLES(80+30*m.nAxes);
+  for (i=0; i<m.nAxes; i++) {
+    m.error[i] -= m.steps[i];
+    if (m.error[i]<0) {
+      m.error[i] += m.major;
+      stepped |= (1<<m.axis[i]);
+    }
+  }
+  stepperPulse(stepped);
+  unsigned int interval = m.ramp.next();
+  if (m.ramp.steps) {
+    OCR1A = 2*interval-1;
+    return;
+  }
+  // this move is done, start the next one or stop
+  gStepperQueueTail = (gStepperQueueTail+1) % kStepperQueueSize;
+  if (gStepperQueueTail!=gStepperQueueHead) {
+    stepperLoadMove();
+  } else {
+    TIMSK1 &= ~(1<<OCIE1A);
+    gStepperRunning = false;
+  }
+}
+
+// find a free entry at the head of the queue; waits if the queue is full
+uint8_t stepperQueueReserve()
+{
+  uint8_t next = (gStepperQueueHead+1) % kStepperQueueSize;
+  while (next==gStepperQueueTail)
+    delayMicroseconds(10);
+  return gStepperQueueHead;
+}
+
+// hand the move at the head of the queue to the interrupt
+void stepperQueuePush()
+{
+  noInterrupts();
+  gStepperQueueHead = (gStepperQueueHead+1) % kStepperQueueSize;
+  if (!gStepperRunning) {
+    gStepperRunning = true;
+    stepperLoadMove();
+    TCNT1 = 0;
+    TIFR1 = (1<<OCF1A);
+    TIMSK1 |= (1<<OCIE1A);
+  }
+  interrupts();
+}
+
+// wait until all queued moves are done
+void stepperWait()
+{
+  while (gStepperRunning)
+    delayMicroseconds(10);
+}
+
+// set up timer 1 to run the step engine
+void setupStepEngine()
+{
+  noInterrupts();
+  TCCR1A = 0;
+  TCCR1B = (1<<WGM12) | (1<<CS11);  // clear timer on compare, clock/8
+  TIMSK1 = 0;
+  interrupts();
+}
+
+
 // ---------------- motors
 
 // ---- roller stepper motor
@@ -252,17 +478,16 @@ const int stepperRDirPin = 29;
 const int stepperRStepPin = 28;
 const int stepperREnablePin = 2;
 const int stepperRDelay = 30;
+const unsigned int stepperRStartInterval = 68;  // microseconds per step from standstill
+const unsigned int stepperRMinInterval = 34;    // microseconds per step at full speed
+const long stepperRAccel = 300000;              // steps per second per second
+
+void stepperMoveAxes(long dx, long dy, long dz1, long dz2, long dr, unsigned int minInterval=0);
 
-void motorRoller(long t, int aDelay=stepperRDelay, int dir=1)
+// turn the roller t times; a delay other than 0 limits the speed to one step every 2*aDelay microseconds
+void motorRoller(long t, int aDelay=0, int dir=1)
 {
-  long i;
-  digitalWrite(stepperRDirPin, dir);
-  for (i=0; i<t*400; i++) {
-    digitalWrite(stepperRStepPin, 0);
-    delayMicroseconds(aDelay);
-    digitalWrite(stepperRStepPin, 1);
-    delayMicroseconds(aDelay);
-  }
+  stepperMoveAxes(0, 0, 0, 0, dir ? t*400 : -t*400, 2*aDelay);
 }
 
 void stepperGotoY(long);
@@ -273,7 +498,7 @@ void motorRollerClean()
   stepperGotoY(4200);
   stepperPowerOn(0x10);
   //motorRoller(100, stepperRDelay, 1);
-  motorRoller(100, stepperRDelay, 0);
+  motorRoller(100, 0, 0);
   //motorRoller(100, stepperRDelay, 1);
 }
 
@@ -295,6 +520,9 @@ const int stepperXStepPin = 32;
 const int stepperXEnablePin = 30;
 const int stepperXEndstopPin = 31;
 const int stepperXDelay = 40;
+const unsigned int stepperXStartInterval = 88;  // microseconds per step from standstill
+const unsigned int stepperXMinInterval = 44;    // microseconds per step at full speed
+const long stepperXAccel = 200000;              // steps per second per second
 
 // ---- y axis stepper motor (6500...28500...49500 Hopper, x...25536 Ink Into Hopper 2)
 const int stepperYDirPin = 37;
@@ -302,7 +530,10 @@ const int stepperYStepPin = 36;
 const int stepperYEnablePin = 34;
 const int stepperYEndstopPin = 35;
 const int stepperYDelay = 140;  // 120
-const int stepperYDelayFast = 80;
+const unsigned int stepperYStartInterval = 280;
+const unsigned int stepperYMinInterval = 80;
+const long stepperYAccel = 50000;
+const long stepperYBuildChamber = 28500;  // y is above the build chamber beyond this
 
 // ---- z1 axis stepper motor
 const int stepperZ1DirPin = 41;
@@ -310,6 +541,9 @@ const int stepperZ1StepPin = 40;
 const int stepperZ1EnablePin = 38;
 const int stepperZ1EndstopPin = 43;
 const int stepperZ1Delay = 40;
+const unsigned int stepperZ1StartInterval = 88;
+const unsigned int stepperZ1MinInterval = 44;
+const long stepperZ1Accel = 100000;
 
 // ---- z2 axis stepper motor
 const int stepperZ2DirPin = 45;
@@ -317,6 +551,57 @@ const int stepperZ2StepPin = 44;
 const int stepperZ2EnablePin = 42;
 const int stepperZ2EndstopPin = 43;
 const int stepperZ2Delay = 40;
+const unsigned int stepperZ2StartInterval = 88;
+const unsigned int stepperZ2MinInterval = 44;
+const long stepperZ2Accel = 100000;
+
+// ---- all axes, in the order of the bits in gStepperPowerMap
+struct StepperAxis
+{
+  int incrementDir;
+  unsigned int startInterval, minInterval;
+  long rampK;                 // 10^12/(2*accel), see StepperRamp
+  long rampStart, rampEnd;    // ramp steps at startInterval and at minInterval
+};
+
+// the ramp is worked out by the compiler, so a move does not divide
+#define STEPPER_AXIS(dir, startInterval, minInterval, accel) \
+  { dir, startInterval, minInterval, (long)(500000000000LL/(accel)), \
+    (long)(500000000000LL/(accel)/((long)(startInterval)*(startInterval))), \
+    (long)(500000000000LL/(accel)/((long)(minInterval)*(minInterval))) }
+
+const StepperAxis gStepperAxis[] = {
+  STEPPER_AXIS(0, stepperXStartInterval,  stepperXMinInterval,  stepperXAccel),
+  STEPPER_AXIS(1, stepperYStartInterval,  stepperYMinInterval,  stepperYAccel),
+  STEPPER_AXIS(0, stepperZ1StartInterval, stepperZ1MinInterval, stepperZ1Accel),
+  STEPPER_AXIS(1, stepperZ2StartInterval, stepperZ2MinInterval, stepperZ2Accel),
+  STEPPER_AXIS(1, stepperRStartInterval,  stepperRMinInterval,  stepperRAccel),
+};
+const int kStepperNAxes = sizeof(gStepperAxis)/sizeof(StepperAxis);
+
+void stepperSetDirections(uint8_t axes, uint8_t dir)
+{
+  if (axes&0x01) FastPin<stepperXDirPin>::write(dir&0x01);
+  if (axes&0x02) FastPin<stepperYDirPin>::write(dir&0x02);
+  if (axes&0x04) FastPin<stepperZ1DirPin>::write(dir&0x04);
+  if (axes&0x08) FastPin<stepperZ2DirPin>::write(dir&0x08);
+  if (axes&0x10) FastPin<stepperRDirPin>::write(dir&0x10);
+}
+
+void stepperPulse(uint8_t axes)
+{
+  if (axes&0x01) FastPin<stepperXStepPin>::low();
+  if (axes&0x02) FastPin<stepperYStepPin>::low();
+  if (axes&0x04) FastPin<stepperZ1StepPin>::low();
+  if (axes&0x08) FastPin<stepperZ2StepPin>::low();
+  if (axes&0x10) FastPin<stepperRStepPin>::low();
+  delayMicroseconds(2); // the drivers need a step pulse of at least 1.9 microseconds
+  if (axes&0x01) FastPin<stepperXStepPin>::high();
+  if (axes&0x02) FastPin<stepperYStepPin>::high();
+  if (axes&0x04) FastPin<stepperZ1StepPin>::high();
+  if (axes&0x08) FastPin<stepperZ2StepPin>::high();
+  if (axes&0x10) FastPin<stepperRStepPin>::high();
+}
 
 // ---- stepper management
 long gStepperCurrentX = 0;
@@ -329,6 +614,7 @@ int gStepperPowerMap = 0; // all off
 
 void stepperPowerOff(int mask)
 {
+  stepperWait();
   int todo = (((~gStepperPowerMap)^mask)&mask);
   if (todo) {
     if (todo&0x0001) digitalWrite(stepperXEnablePin, 1);
@@ -354,6 +640,80 @@ void stepperPowerOn(int mask)
   }
 }
 
+// queue a move of up to five axes that start and stop together; the speed
+// and acceleration are those of the axis that reaches its limit first, and
+// minInterval can slow the farthest moving axis down even more
+void stepperMoveAxes(long dx, long dy, long dz1, long dz2, long dr, unsigned int minInterval)
+{
+  long d[kStepperNAxes] = { dx, dy, dz1, dz2, dr };
+  long n, major = 0;
+  int i, mask = 0, nAxes = 0, last = 0;
+  IOTA_CYCLES(300);
+  for (i=0; i<kStepperNAxes; i++) {
+    n = d[i]<0 ? -d[i] : d[i];
+    if (n) {
+      mask |= (1<<i);
+      nAxes++;
+      last = i;
+    }
+    if (n>major) major = n;
+  }
+  if (!major) return;
+  stepperPowerOn(mask);
+  gStepperCurrentX += dx;
+  gStepperCurrentY += dy;
+  gStepperCurrentZ1 += dz1;
+  gStepperCurrentZ2 += dz2;
+  StepperMove &m = gStepperQueue[stepperQueueReserve()];
+  m.nAxes = 0;
+  m.axes = mask;
+  m.dir = 0;
+  m.major = major;
+  for (i=0; i<kStepperNAxes; i++) {
+    if (!d[i]) continue;
+    const StepperAxis &a = gStepperAxis[i];
+    uint8_t k = m.nAxes++;
+    m.axis[k] = i;
+    if ((d[i]>0) == (a.incrementDir==1)) m.dir |= (1<<i);
+    m.steps[k] = d[i]<0 ? -d[i] : d[i];
+    m.error[k] = major>>1;
+  }
+  if (nAxes==1) {
+    // the usual case, and the only one while printing: take the ramp of the
+    // axis as it is
+    const StepperAxis &a = gStepperAxis[last];
+    if (minInterval>a.minInterval) {
+      IOTA_CYCLES(650);
+      unsigned int startInterval = minInterval>a.startInterval ? minInterval : a.startInterval;
+      m.ramp.start(major, startInterval, minInterval,
+                   a.rampK/((long)startInterval*startInterval), a.rampK/((long)minInterval*minInterval));
+    } else {
+      m.ramp.start(major, a.startInterval, a.minInterval, a.rampStart, a.rampEnd);
+    }
+  } else {
+    // scale the limits of every axis to steps of the major axis
+    unsigned int startInterval = minInterval;
+    unsigned long rampK = 0;
+    for (i=0; i<m.nAxes; i++) {
+      const StepperAxis &a = gStepperAxis[m.axis[i]];
+      IOTA_CYCLES(750);
+      // this axis moves r/256 as fast as the major axis, rounded up
+      unsigned int r = ((m.steps[i]<<8)+major-1)/major;
+      unsigned int v = ((unsigned long)a.startInterval*r)>>8;
+      if (v>startInterval) startInterval = v;
+      v = ((unsigned long)a.minInterval*r)>>8;
+      if (v>minInterval) minInterval = v;
+      unsigned long k = ((unsigned long)a.rampK>>8)*r;
+      if (k>rampK) rampK = k;
+    }
+    if (minInterval>startInterval) startInterval = minInterval;
+    IOTA_CYCLES(1300);
+    m.ramp.start(major, startInterval, minInterval,
+                 rampK/((long)startInterval*startInterval), rampK/((long)minInterval*minInterval));
+  }
+  stepperQueuePush();
+}
+
 void stepperPowerX(int onOff)
 {
   if (onOff)
@@ -365,27 +725,28 @@ void stepperPowerX(int onOff)
 void stepperHomeX()
 {
   int i;
+  stepperWait();
   stepperPowerOn(0x0001);
   // first make sure that we are not already in the home zone
-  digitalWrite(stepperXDirPin, 0); // increment
+  FastPin<stepperXDirPin>::low(); // increment
   for (i=0; i<1000; i++) {
     if (!digitalRead(stepperXEndstopPin)) {
       break;
     }
-    digitalWrite(stepperXStepPin, 0);
+    FastPin<stepperXStepPin>::low();
     delayMicroseconds(stepperXDelay);
-    digitalWrite(stepperXStepPin, 1);
+    FastPin<stepperXStepPin>::high();
     delayMicroseconds(stepperXDelay);
   }
   // now find the beginning of the home zone
-  digitalWrite(stepperXDirPin, 1); // decrement
+  FastPin<stepperXDirPin>::high(); // decrement
   for (i=0; i<100000; i++) {
     if (digitalRead(stepperXEndstopPin)) {
       break;
     }
-    digitalWrite(stepperXStepPin, 0);
+    FastPin<stepperXStepPin>::low();
     delayMicroseconds(stepperXDelay);
-    digitalWrite(stepperXStepPin, 1);
+    FastPin<stepperXStepPin>::high();
     delayMicroseconds(stepperXDelay);
   }
   gStepperCurrentX = 0;
@@ -394,21 +755,7 @@ void stepperHomeX()
 
 void stepperMoveX(long dx)
 {
-  long i;
-  stepperPowerOn(0x0001);
-  gStepperCurrentX += dx;
-  if (dx<0) {
-    digitalWrite(stepperXDirPin, 1); // decrement
-    dx = -dx;
-  } else {
-    digitalWrite(stepperXDirPin, 0); // increment
-  }
-  for (i=0; i<dx; i++) {
-    digitalWrite(stepperXStepPin, 0);
-    delayMicroseconds(stepperXDelay);
-    digitalWrite(stepperXStepPin, 1);
-    delayMicroseconds(stepperXDelay);
-  }
+  stepperMoveAxes(dx, 0, 0, 0, 0);
 }
 
 void stepperGotoX(long x)
@@ -437,14 +784,15 @@ void stepperHomeY()
     if (gStepperCurrentY>1350*3) // sefatyzone is 3cm
       stepperGotoY(1350*3);
   }
-  digitalWrite(stepperYDirPin, 0); // decrement
+  stepperWait();
+  FastPin<stepperYDirPin>::low(); // decrement
   for (i=0; i<100000; i++) {
     if (digitalRead(stepperYEndstopPin)) {
       break;
     }
-    digitalWrite(stepperYStepPin, 0);
+    FastPin<stepperYStepPin>::low();
     delayMicroseconds(stepperYDelay);
-    digitalWrite(stepperYStepPin, 1);
+    FastPin<stepperYStepPin>::high();
     delayMicroseconds(stepperYDelay);
   }
   gStepperCurrentY = 0;
@@ -453,50 +801,7 @@ void stepperHomeY()
 
 void stepperMoveY(long dy)
 {
-  long i;
-  stepperPowerOn(0x0002);
-  gStepperCurrentY += dy;
-  if (dy<0) {
-    digitalWrite(stepperYDirPin, 0); // decrement
-    dy = -dy;
-  } else {
-    digitalWrite(stepperYDirPin, 1); // increment
-  }
-  int accel = stepperYDelay - stepperYDelayFast;
-  int rampUp, constSpeed, rampDown, currentDelay;
-  if (2*accel > dy) {
-    rampUp = dy/2;
-    rampDown = dy-rampUp;
-    constSpeed = 0;
-  } else {
-    rampUp = accel;
-    rampDown = accel;
-    constSpeed = dy - rampUp - rampDown;
-  }
-  // ramp up
-  currentDelay = stepperYDelay;
-  for (i=0; i<rampUp; i++) {
-    digitalWrite(stepperYStepPin, 0);
-    delayMicroseconds(currentDelay);
-    digitalWrite(stepperYStepPin, 1);
-    delayMicroseconds(currentDelay);
-    currentDelay--;
-  }
-  // const speed
-  for (i=0; i<constSpeed; i++) {
-    digitalWrite(stepperYStepPin, 0);
-    delayMicroseconds(currentDelay);
-    digitalWrite(stepperYStepPin, 1);
-    delayMicroseconds(currentDelay);
-  }
-  // ramp udown
-  for (i=0; i<rampDown; i++) {
-    digitalWrite(stepperYStepPin, 0);
-    delayMicroseconds(currentDelay);
-    digitalWrite(stepperYStepPin, 1);
-    delayMicroseconds(currentDelay);
-    currentDelay++;
-  }
+  stepperMoveAxes(0, dy, 0, 0, 0);
 }
 
 void stepperGotoY(long y)
@@ -507,31 +812,8 @@ void stepperGotoY(long y)
 
 void stepperSpreadTo(long y)
 {
-  long i;
-  int j, rd = stepperYDelay / 4;
   long dy = y-gStepperCurrentY;
-  stepperPowerOn(0x0012);
-  gStepperCurrentY += dy;
-  if (dy<0) {
-    digitalWrite(stepperYDirPin, 0);
-    digitalWrite(stepperRDirPin, 1);
-    dy = -dy;
-  } else {
-    digitalWrite(stepperYDirPin, 1);
-    digitalWrite(stepperRDirPin, 0);
-  }
-  for (i=0; i<dy; i++) {
-    for (j=0; j<4; j++) {
-      if (j==0)
-        digitalWrite(stepperYStepPin, 0);
-      digitalWrite(stepperRStepPin, 0);
-      delayMicroseconds(rd);
-      if (j==0)
-        digitalWrite(stepperYStepPin, 1);
-      digitalWrite(stepperRStepPin, 1);
-      delayMicroseconds(rd);
-    }
-  }
+  stepperMoveAxes(0, dy, 0, 0, -4*dy);  // 4 roller steps for every y step
 }
 
 void stepperPowerZ1(int onOff)
@@ -545,15 +827,16 @@ void stepperPowerZ1(int onOff)
 void stepperHomeZ1()
 {
   int i;
+  stepperWait();
   stepperPowerOn(0x0004);
-  digitalWrite(stepperZ1DirPin, 1); // decrement
+  FastPin<stepperZ1DirPin>::high(); // decrement
   for (i=0; i<100000; i++) {
     if (digitalRead(stepperZ1EndstopPin)) {
       break;
     }
-    digitalWrite(stepperZ1StepPin, 0);
+    FastPin<stepperZ1StepPin>::low();
     delayMicroseconds(stepperZ1Delay);
-    digitalWrite(stepperZ1StepPin, 1);
+    FastPin<stepperZ1StepPin>::high();
     delayMicroseconds(stepperZ1Delay);
   }
   gStepperCurrentZ1 = 0;
@@ -561,21 +844,7 @@ void stepperHomeZ1()
 
 void stepperMoveZ1(long dx)
 {
-  long i;
-  stepperPowerOn(0x0004);
-  gStepperCurrentZ1 += dx;
-  if (dx<0) {
-    digitalWrite(stepperZ1DirPin, 1); // decrement
-    dx = -dx;
-  } else {
-    digitalWrite(stepperZ1DirPin, 0); // increment
-  }
-  for (i=0; i<dx; i++) {
-    digitalWrite(stepperZ1StepPin, 0);
-    delayMicroseconds(stepperZ1Delay);
-    digitalWrite(stepperZ1StepPin, 1);
-    delayMicroseconds(stepperZ1Delay);
-  }
+  stepperMoveAxes(0, 0, dx, 0, 0);
 }
 
 void stepperGotoZ1(long x)
@@ -594,15 +863,16 @@ void stepperPowerZ2(int onOff)
 void stepperHomeZ2()
 {
   int i;
+  stepperWait();
   stepperPowerOn(0x0008);
-  digitalWrite(stepperZ2DirPin, 1); // decrement
+  FastPin<stepperZ2DirPin>::high(); // decrement
   for (i=0; i<100000; i++) {
     if (digitalRead(stepperZ2EndstopPin)) {
       break;
     }
-    digitalWrite(stepperZ2StepPin, 0);
+    FastPin<stepperZ2StepPin>::low();
     delayMicroseconds(stepperZ2Delay);
-    digitalWrite(stepperZ2StepPin, 1);
+    FastPin<stepperZ2StepPin>::high();
     delayMicroseconds(stepperZ2Delay);
   }
   gStepperCurrentZ2 = 0;
@@ -610,21 +880,7 @@ void stepperHomeZ2()
 
 void stepperMoveZ2(long dx)
 {
-  long i;
-  stepperPowerOn(0x0008);
-  gStepperCurrentZ2 += dx;
-  if (dx<0) {
-    digitalWrite(stepperZ2DirPin, 0); // decrement
-    dx = -dx;
-  } else {
-    digitalWrite(stepperZ2DirPin, 1); // increment
-  }
-  for (i=0; i<dx; i++) {
-    digitalWrite(stepperZ2StepPin, 0);
-    delayMicroseconds(stepperZ2Delay);
-    digitalWrite(stepperZ2StepPin, 1);
-    delayMicroseconds(stepperZ2Delay);
-  }
+  stepperMoveAxes(0, 0, 0, dx, 0);
 }
 
 void stepperGotoZ2(long x)
@@ -658,6 +914,8 @@ void setupSteppers()
   digitalWrite(stepperZ2EnablePin, 1);
   pinMode(stepperZ2EnablePin, OUTPUT);  //
   pinMode(stepperZ2EndstopPin, INPUT_PULLUP);  //
+  
+  setupStepEngine();
 }
 
 // dz is int 100th mm
@@ -665,51 +923,79 @@ void stepperSpreadLayer(long dz) {
   stepperPowerOn(0x001f);          // power on all needed motors (all of them, actually)
   stepperHomeX();                  // move the head to the left where it might get less dirty
   stepperPowerOff(0x0001);         // we are done with the x axis
-  stepperHomeY();                  // now home the y axis, so we have a zero reference
-  stepperMoveZ1((-100)*16);        // lower the supply piston to loosen up the powder
-  stepperMoveZ1((100+50+dz)*16);   // raise the supply piston, so a 'dz' mm layer gets scraped off
-  stepperMoveZ2((50)*16);          // raise the build piston a bit, so the powder is evenly spread
+  if (gStepperCurrentYKnown && gStepperCurrentY>stepperYBuildChamber) {
+    // move the pistons while y comes back, but not the one that y is above
+    stepperMoveAxes(0, stepperYBuildChamber-gStepperCurrentY, (-100)*16, 0, 0); // lower the supply piston to loosen up the powder
+    stepperMoveAxes(0, 1350*3-gStepperCurrentY, 0, (50)*16, 0);                 // raise the build piston a bit, so the powder is evenly spread
+    stepperHomeY();                // now home the y axis, so we have a zero reference
+    stepperMoveZ1((100+50+dz)*16); // raise the supply piston, so a 'dz' mm layer gets scraped off
+  } else {
+    stepperHomeY();                // now home the y axis, so we have a zero reference
+    stepperMoveZ1((-100)*16);      // lower the supply piston to loosen up the powder
+    stepperMoveZ1((100+50+dz)*16); // raise the supply piston, so a 'dz' mm layer gets scraped off
+    stepperMoveZ2((50)*16);        // raise the build piston a bit, so the powder is evenly spread
+  }
   motorRollerClean();
   stepperGotoY(6500);              // position the y axis in front of the supply chamber
   stepperSpreadTo(49500);            // now move y and roll to the maximum y position
-  stepperMoveZ2((-50)*16);         // lower the build piston a bit, so the powder is not disturbed when y moves back
-  stepperMoveZ1((-50)*16);         // same for the supply piston
+  stepperMoveAxes(0, 0, (-50)*16, (-50)*16, 0); // lower both pistons a bit, so the powder is not disturbed when y moves back
 }
 
 
 
 // ---------------- ink
 
+#if IOTA_INK_SPI
+const int inkClockPin = 52;  // SCK
+const int inkDataPin = 51;   // MOSI
+#else
 const int inkClockPin = 47;
 const int inkDataPin = 46;
+#endif
 const int inkEnablePin = 48;
 const int inkStrobePin = 49;
+const int inkColumnSteps = 36; // x steps per pattern, no matter how many drops
+
+// the word that we shift out to select a nozzle; 12 to 15 select an output
+// that is not connected
+const uint16_t inkNozzleSelect[16] = {
+  1<<3, 1<<1, 1<<10, 1<<5, 1<<2, 1<<6, 1<<9, 1<<7,
+  1<<0, 1<<4, 1<<8, 1<<11, 1<<15, 1<<15, 1<<15, 1<<15
+};
 
 void inkFireNozzle(int n)
 {
-  //static unsigned char lut[] = { 3, 10, 2, 9, 0, 8, 1, 5, 6, 7, 4, 11, 15, 15, 15, 15 };
-  static unsigned char lut[] = { 3, 1, 10, 5, 2, 6, 9, 7, 0, 4, 8, 11, 15, 15, 15, 15 };
-  int i;
-  n = lut[n&15];
-  // shift the value in
-  for (i=15; i>=0; i--) {
-    if (i==n) {
-      digitalWrite(inkDataPin, 1);
-    } else {
-      digitalWrite(inkDataPin, 0);
-    }
-    digitalWrite(inkClockPin, 1);
-    digitalWrite(inkClockPin, 0);
+  uint16_t select = inkNozzleSelect[n&15];
+  IOTA_CYCLES(120);
+  // the carriage must have arrived before we fire
+  stepperWait();
+  // shift the value in, highest bit first
+#if IOTA_INK_SPI
+  // the SD card leaves garbage in the shift register, but only the strobe
+  // below copies it to the outputs
+  uint8_t spcr = SPCR, spsr = SPSR;
+  // master, mode 0, highest bit first, and the clock rate as SPI.setClockDivider() sets it
+  SPCR = (1<<SPE) | (1<<MSTR) | (IOTA_INK_SPI_CLOCK & 0x03);
+  SPSR = (IOTA_INK_SPI_CLOCK>>2) & 0x01;
+  SPI.transfer(select>>8);
+  SPI.transfer(select&0xff);
+  SPCR = spcr;
+  SPSR = spsr;
+#else
+  uint16_t bit;
+  for (bit=0x8000; bit; bit>>=1) {
+    FastPin<inkDataPin>::write((select&bit)!=0);
+    FastPin<inkClockPin>::high();
+    FastPin<inkClockPin>::low();
   }
+#endif
   // fire what we shifted in
-  digitalWrite(inkStrobePin, 0);
-  digitalWrite(inkStrobePin, 1);
+  FastPin<inkStrobePin>::low();
+  FastPin<inkStrobePin>::high();
   noInterrupts();
-  //digitalWrite(inkEnablePin, 0);
-  PORTL &= B11111101;
+  FastPin<inkEnablePin>::low();
   delayMicroseconds(4);
-  PORTL |= B00000010;
-  //digitalWrite(inkEnablePin, 1);
+  FastPin<inkEnablePin>::high();
   interrupts();
 }
 
@@ -861,8 +1147,12 @@ void inkWrite(char *text)
 void setupInk()
 {
   digitalWrite(inkEnablePin, 1);
+#if IOTA_INK_SPI
+  SPI.begin();
+#else
   pinMode(inkClockPin, OUTPUT);
   pinMode(inkDataPin, OUTPUT);
+#endif
   pinMode(inkEnablePin, OUTPUT);
   pinMode(inkStrobePin, OUTPUT);
 }
@@ -886,21 +1176,103 @@ File gInterpreterFile;
 
 // ---------------- SD Card file system
 
+// The file is read in whole 512 byte sectors into one of two buffers, and
+// numbers are decoded from RAM. While one buffer is being decoded, the
+// other one is filled by interpreterPrefetch() whenever the carriage moves
+// without firing, so that reading the card does not stall the ink head.
+
+const int kInterpreterBufferSize = 512;
+unsigned char gInterpreterBuffer[2][kInterpreterBufferSize];
+int gInterpreterBufferFill[2] = { 0, 0 };      // number of bytes read
+boolean gInterpreterBufferReady[2] = { false, false };
+int gInterpreterBufferIndex = 0;               // the buffer we are decoding
+int gInterpreterBufferPos = 0;                 // next byte in that buffer
+long gInterpreterBufferStart = 0;              // file position of its first byte
+
+// read the next sector of the file into a buffer
+void interpreterFillBuffer(int i)
+{
+  int n = gInterpreterFile.read(gInterpreterBuffer[i], kInterpreterBufferSize);
+  gInterpreterBufferFill[i] = (n<0) ? 0 : n;
+  gInterpreterBufferReady[i] = true;
+}
+
+// fill the next buffer ahead of time; call this before moves that don't fire
+void interpreterPrefetch()
+{
+  int next = gInterpreterBufferIndex^1;
+  if (!gInterpreterBufferReady[next] && gInterpreterBufferFill[gInterpreterBufferIndex]==kInterpreterBufferSize)
+    interpreterFillBuffer(next);
+}
+
+// continue reading at any position in the file
+boolean interpreterSeek(long pos)
+{
+  int i = gInterpreterBufferIndex;
+  if (gInterpreterBufferReady[i] && pos>=gInterpreterBufferStart
+      && pos<gInterpreterBufferStart+gInterpreterBufferFill[i]) {
+    // still in the current buffer
+    gInterpreterBufferPos = pos-gInterpreterBufferStart;
+    return true;
+  }
+  // start over with the sector that holds pos
+  long start = pos & ~(long)(kInterpreterBufferSize-1);
+  gInterpreterBufferReady[0] = gInterpreterBufferReady[1] = false;
+  gInterpreterBufferFill[0] = gInterpreterBufferFill[1] = 0;
+  if (!gInterpreterFile.seek(start)) return false;
+  gInterpreterBufferIndex = 0;
+  gInterpreterBufferStart = start;
+  interpreterFillBuffer(0);
+  gInterpreterBufferPos = pos-start;
+  return gInterpreterBufferPos<=gInterpreterBufferFill[0];
+}
+
+// file position of the next byte
+long interpreterPosition()
+{
+  return gInterpreterBufferStart+gInterpreterBufferPos;
+}
+
+int interpreterReadByte()
+{
+  int i = gInterpreterBufferIndex;
+  if (gInterpreterBufferPos>=gInterpreterBufferFill[i]) {
+    // a buffer that is not full was the end of the file
+    if (gInterpreterBufferFill[i]<kInterpreterBufferSize) return -1;
+    gInterpreterBufferReady[i] = false;
+    i ^= 1;
+    if (!gInterpreterBufferReady[i])
+      interpreterFillBuffer(i);
+    gInterpreterBufferIndex = i;
+    gInterpreterBufferStart += kInterpreterBufferSize;
+    gInterpreterBufferPos = 0;
+    if (gInterpreterBufferFill[i]==0) return -1;
+  }
+  return gInterpreterBuffer[i][gInterpreterBufferPos++];
+}
+
+boolean interpreterAvailable()
+{
+  int i = gInterpreterBufferIndex;
+  return gInterpreterBufferPos<gInterpreterBufferFill[i]
+      || (gInterpreterBufferFill[i]==kInterpreterBufferSize && gInterpreterFile.size()>interpreterPosition());
+}
+
 int interpreterReadShort()
 {
   int ub, ret = 0;
   // read bit 0..6
-  ub = gInterpreterFile.read();
+  ub = interpreterReadByte();
   if (ub==-1) return -1; // should not happen
   ret = ub & 0x7f;
   if (ub&0x80) {
     // shift to 13..7 and read bit 0..6
-    ub = gInterpreterFile.read();
+    ub = interpreterReadByte();
     ret = (ret<<7) | (ub & 0x7f);
   }
   if (ub&0x80) {
     // shift to 20..14 (some bits lost) and read bit 0..6
-    ub = gInterpreterFile.read();
+    ub = interpreterReadByte();
     ret = (ret<<7) | (ub & 0x7f);
   }
   return ret;
@@ -911,27 +1283,27 @@ long interpreterReadLong()
   int ub;
   long ret = 0;
   // read bit 0..6
-  ub = gInterpreterFile.read();
+  ub = interpreterReadByte();
   if (ub==-1) return -1; // should not happen
   ret = ub & 0x7f;
   if (ub&0x80) {
     // shift to 13..7 and read bit 0..6
-    ub = gInterpreterFile.read();
+    ub = interpreterReadByte();
     ret = (ret<<7) | (ub & 0x7f);
   }
   if (ub&0x80) {
     // shift to 20..14 and read bit 0..6
-    ub = gInterpreterFile.read();
+    ub = interpreterReadByte();
     ret = (ret<<7) | (ub & 0x7f);
   }
   if (ub&0x80) {
     // shift to 27..21 and read bit 0..6
-    ub = gInterpreterFile.read();
+    ub = interpreterReadByte();
     ret = (ret<<7) | (ub & 0x7f);
   }
   if (ub&0x80) {
     // shift to 34..28 (some bits are lost) and read bit 0..6
-    ub = gInterpreterFile.read();
+    ub = interpreterReadByte();
     ret = (ret<<7) | (ub & 0x7f);
   }
   return ret;
@@ -954,10 +1326,28 @@ void interpFirePatternN(void*)
   inkFirePattern(pattern, nDrops);
 }
 
+// 3: fire the same pattern into the next n columns
+void interpFirePatternRepeat(void*)
+{
+  int pattern = interpreterReadShort();
+  int nDrops = interpreterReadShort();
+  int repeat = interpreterReadShort();
+  inkFirePattern(pattern, nDrops, repeat);
+}
+
+// 4: skip n empty columns
+void interpSkipColumns(void*)
+{
+  long n = interpreterReadLong();
+  interpreterPrefetch();
+  stepperMoveX(n*inkColumnSteps);
+}
+
 // 144:
 void interpGotoX(void*)
 {
   long x = interpreterReadLong();
+  interpreterPrefetch();
   stepperGotoX(x);
 }
 
@@ -965,6 +1355,7 @@ void interpGotoX(void*)
 void interpMoveX(void*)
 {
   long dx = interpreterReadLong();
+  interpreterPrefetch();
   stepperMoveX(dx);
 }
 
@@ -979,6 +1370,7 @@ void interpHomeX(void*)
 void interpGotoY(void*)
 {
   long y = interpreterReadLong();
+  interpreterPrefetch();
   stepperGotoY(y);
 }
 
@@ -986,6 +1378,7 @@ void interpGotoY(void*)
 void interpMoveY(void*)
 {
   long dy = interpreterReadLong();
+  interpreterPrefetch();
   stepperMoveY(dy);
 }
 
@@ -1006,6 +1399,7 @@ void interpCleanRoller(void*)
 void interpSpread(void*)
 {
   long dz = interpreterReadLong(); // z height in steps (no, currentli in mm (FIXME!))
+  interpreterPrefetch();
   stepperMoveZ2(-dz*16);
   stepperSpreadLayer(dz);
 }
@@ -1017,7 +1411,7 @@ void interpNumLayers(void*)
 }
 
 CallbackPtr interpreterCommandLUT[] = {
-  0L, interpFirePattern, interpFirePatternN, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, // 0
+  0L, interpFirePattern, interpFirePatternN, interpFirePatternRepeat, interpSkipColumns, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, // 0
   0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L,
   0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L,
   0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L,
@@ -1038,7 +1432,61 @@ CallbackPtr interpreterCommandLUT[] = {
   // 158 spread
 };
 
-void interpreterRunFromSD(const char *name)
+// build piston position at the start of the last print, and the file that
+// was printed; a resume only trusts it for the same file
+long gInterpreterZ2Start = 0;
+char gInterpreterZ2StartName[13] = "";
+
+// find the start of a layer in the index at the end of a version 3 file
+// returns the file position, or -1 if the file has no such layer
+// dz receives the sum of all spreads before that layer in 1/100 mm
+long interpreterFindLayer(long layer, long &nLayers, long &dz)
+{
+  long size = gInterpreterFile.size();
+  if (size<12 || !interpreterSeek(size-5)) return -1;
+  long index = interpreterReadLong();
+  if (index<0 || index>size-12 || !interpreterSeek(index)) return -1;
+  if (interpreterReadShort()!=131) return -1;
+  nLayers = interpreterReadLong();
+  if (layer<1 || layer>nLayers) return -1;
+  // two bytes for 131, five for the count, then five for the offset and
+  // five for the dz of every layer
+  if (!interpreterSeek(index+10*layer-3)) return -1;
+  long pos = interpreterReadLong();
+  dz = interpreterReadLong();
+  return pos;
+}
+
+// read through a file without running any commands, up to the spread
+// command that starts a layer; used if a file has no layer index
+// returns the file position, or -1 if the file has no such layer
+// dz receives the sum of all spreads before that layer in 1/100 mm
+long interpreterScanToLayer(long layer, long &nLayers, long &dz)
+{
+  long currentLayer = 0;
+  dz = 0;
+  for ( ; interpreterAvailable(); ) {
+    long pos = interpreterPosition();
+    int cmd = interpreterReadShort();
+    int nArgs = 0;
+    switch (cmd) {
+      case 158:
+        if (++currentLayer==layer) return pos;
+        dz += interpreterReadLong();
+        break;
+      case 159: nLayers = interpreterReadLong(); break;
+      case 1: case 4: case 144: case 145: case 146: case 147: case 148: case 149: nArgs = 1; break;
+      case 2: nArgs = 2; break;
+      case 3: nArgs = 3; break;
+      case 157: break;
+      default: return -1; // we don't know how to skip this
+    }
+    while (nArgs--) interpreterReadLong();
+  }
+  return -1;
+}
+
+void interpreterRunFromSD(const char *name, long startLayer=1)
 {
   SD.begin(driveSelectPin);
   gInterpreterFile = SD.open(name);
@@ -1046,15 +1494,42 @@ void interpreterRunFromSD(const char *name)
     firmwareError("", "Can't open file:", name);
     return;
   }
-  long currentLayer = 1;
+  interpreterSeek(0);
+  long currentLayer = 0;
   long nLayers = 0;
   interpreterReadLong();
   interpreterReadLong();
   interpreterReadLong();
-  interpreterReadLong();
-  for ( ; gInterpreterFile.available(); ) {
+  long version = interpreterReadLong();
+  if (startLayer>1) {
+    long pos = -1, dz = 0, start = interpreterPosition();
+    if (version>=3)
+      pos = interpreterFindLayer(startLayer, nLayers, dz);
+    if (pos<0 && interpreterSeek(start))
+      pos = interpreterScanToLayer(startLayer, nLayers, dz);
+    if (pos<0 || !interpreterSeek(pos)) {
+      gInterpreterFile.close();
+      SD.end();
+      firmwareError("", "Can't find layer in", name);
+      return;
+    }
+    currentLayer = startLayer-1;
+    // every spread lowers the build piston by dz, see interpSpread()
+    if (strcmp(gInterpreterZ2StartName, name)==0) {
+      stepperGotoZ2(gInterpreterZ2Start-dz*16);
+    } else {
+      // after a power cycle, or if another file was printed since, assume
+      // the piston is still where the layer before startLayer left it
+      gInterpreterZ2Start = gStepperCurrentZ2+dz*16;
+    }
+  } else {
+    gInterpreterZ2Start = gStepperCurrentZ2;
+  }
+  strncpy(gInterpreterZ2StartName, name, sizeof(gInterpreterZ2StartName)-1);
+  for ( ; interpreterAvailable(); ) {
     int cmd = interpreterReadShort();
     if (cmd==-1) break;
+    if (cmd==131) break; // the layer index follows the last layer
     if (cmd==158 || cmd==159) {
       char buf[24];
       if (cmd==158) currentLayer++;
@@ -1089,6 +1564,7 @@ void interpreterRunFromSD(const char *name)
       }
     }
   }  
+  stepperWait();
   gInterpreterFile.close();
   SD.end();
 }
@@ -1106,11 +1582,11 @@ void interpreterRunFromSDCB(void *name)
     delay(100);
     char buf[12];
     ltoa(startLayer, buf, 10);
-    displayAt(3, 14, buf);
     displayAt(3, 14, "     ");
+    displayAt(3, 14, buf);
     switch (keysScan() | (gKeysDown&(kKeyUp|kKeyDown))) {
       case kKeyBack: return;
-      case kKeyUp: startLayer--; break;
+      case kKeyUp: if (startLayer>0) startLayer--; break;
       case kKeyDown: startLayer++; break;
       case kKeyOK: goto cont1;
     }
@@ -1122,7 +1598,7 @@ cont1:
                 " Layer ?/?         |",
                 "[Brk][Pse]       --+");
   displayAt(2, 3, (const char*)name);
-  interpreterRunFromSD((const char*)name);
+  interpreterRunFromSD((const char*)name, startLayer);
 }
 
 
@@ -1169,7 +1645,7 @@ void firmwarePowerOffXCB(void*)
 
 void firmwareMoveXCB(void *d)
 {
-  int dist = (int)d;
+  int dist = (int)(long)d;
   int dist_lut[] = { 5000, 500, 50 };
   displayScreen(
                 "Move X Axis",
@@ -1204,7 +1680,7 @@ void firmwarePowerOffYCB(void*)
 
 void firmwareMoveYCB(void *d)
 {
-  int dist = (int)d;
+  int dist = (int)(long)d;
   int dist_lut[] = { 5000, 500, 50 };
   displayScreen(
                 "Move Y Axis",
@@ -1239,7 +1715,7 @@ void firmwarePowerOffZ1CB(void*)
 
 void firmwareMoveZ1CB(void *d)
 {
-  int dist = (int)d;
+  int dist = (int)(long)d;
   int dist_lut[] = { 5000, 500, 50 };
   displayScreen(
                 "Move Z1 Axis",
@@ -1274,7 +1750,7 @@ void firmwarePowerOffZ2CB(void*)
 
 void firmwareMoveZ2CB(void *d)
 {
-  int dist = (int)d;
+  int dist = (int)(long)d;
   int dist_lut[] = { 5000, 500, 50 };
   displayScreen(
                 "Move Z2 Axis",
@@ -1302,7 +1778,7 @@ void firmwareMoveZ2CB(void *d)
 // dz is in 100th mm
 //
 void firmwareSpreadLayerCB(void *d) {
-  int dz = (int)d;
+  int dz = (int)(long)d;
   stepperSpreadLayer(dz);
   stepperGotoY(21500-1000);        // ready to print
   stepperPowerOff(0x001f);         // in interactive mode, power everything off?
@@ -1332,7 +1808,7 @@ void firmwareRollerPowerOffCB(void*)
 void firmwareRollerMoveCB(void *d)
 {
   stepperPowerOn(0x0010);
-  switch ((int)d) {
+  switch ((int)(long)d) {
     case 0:
       motorRoller(20, stepperRDelay, 1);
       break;
@@ -1458,7 +1934,7 @@ bail:
 
 void firmwarePrintCB(void *d)
 {
-  int what = (int)d;
+  int what = (int)(long)d;
   int i, j, k;
   static const int lut[] = { 1, 5, 8, 10, 15, 35 };
   static const int lut2[] = { 1, 3, 7, 12, 15 };
@@ -59,6 +59,8 @@ fire 2048
 #include <fltk3/fltk3.h>
 #include "ItTextEditor.h"
 
+#include <vector>
+
 
 Fl_Window *gMainWindow;
 Fl_MenuBar *gMainMenu;
@@ -111,6 +113,16 @@ void writeInt(FILE *f, int32_t x)
   fputc(v, f);
 }
 
+// same as writeInt, but always five bytes long, so it can be found in a table
+void writeFixedInt(FILE *f, int32_t x)
+{
+  fputc(((x>>28) & 0x7f) | 0x80, f);
+  fputc(((x>>21) & 0x7f) | 0x80, f);
+  fputc(((x>>14) & 0x7f) | 0x80, f);
+  fputc(((x>>7) & 0x7f) | 0x80, f);
+  fputc(x & 0x7f, f);
+}
+
 char *tmpBuf = 0;
 int nTmpBuf = 0, NTmpBuf = 0;
 
@@ -212,7 +224,7 @@ void skipEOL(stringRef src)
   }
 }
 
-void writeIntArg(FILE *f, stringRef src)
+int32_t writeIntArg(FILE *f, stringRef src)
 {
   skipSpace(src);
   int32_t v = 0, sign = 1;
@@ -223,7 +235,7 @@ void writeIntArg(FILE *f, stringRef src)
   }
   if (*src<0 || *src>'9') {
     printf("Integer expected!\n");
-    return;
+    return 0;
   }
   for (;;) {
     if (*src<'0' || *src>'9') break;
@@ -232,6 +244,7 @@ void writeIntArg(FILE *f, stringRef src)
     src++;
   }
   writeInt(f, sign*v);
+  return sign*v;
 }
 
 void writeTextArg(FILE *f, stringRef src)
@@ -304,8 +317,8 @@ static void mainMenuFileOpenCB(Fl_Widget*, void*)
     fclose(f);
     return;
   }
-  if (version>1) {
-    fprintf(stderr, "File version %d is greater than supported version 1\n", version);
+  if (version>3) {
+    fprintf(stderr, "File version %d is greater than supported version 3\n", version);
   }
   nTmpBuf = 0;
   int err = 0;
@@ -335,9 +348,17 @@ static void mainMenuFileOpenCB(Fl_Widget*, void*)
       case 157: addText("rStop"); addNewLine(); break;
       case 158: addText("spread "); addIntArg(f); addNewLine(); break;
       case   1: addText("fire "); addIntArg(f); addNewLine(); break;
+      case   2: addText("fireN "); addIntArg(f), addText(", "); addIntArg(f); addNewLine(); break;
+      case   3: addText("fireRepeat "); addIntArg(f), addText(", "); addIntArg(f), addText(", "); addIntArg(f); addNewLine(); break;
+      case   4: addText("skip "); addIntArg(f); addNewLine(); break;
       case 138: addText("fireNozzle "); addIntArg(f); addNewLine(); break;
       case 160: addText("delay "); addIntArg(f); addNewLine(); break;
       case 161: addText("repeat "); addIntArg(f); addText(" "); break;
+      case 131: { // layer index, written again when saving
+        int32_t i, n = readInt(f);
+        if (version>=3) n = 2*n; // offset and dz of every layer
+        for (i=0; i<=n; i++) readInt(f);
+        break; }
         // motorOn bitmask, motorOff bitmask
       case 192: addText("setFireRepeat "); addIntArg(f); addNewLine(); break;
       case 193: addText("setFireAdvance "); addIntArg(f); addNewLine(); break;
@@ -363,8 +384,10 @@ void saveFile(const char *fn)
   writeInt(f, 23);  // Magic
   writeInt(f, 3);
   writeInt(f, 2013);
-  writeInt(f, 1);   // File Version
+  writeInt(f, 3);   // File Version
   
+  std::vector<int32_t> layerOffset, layerDz;
+  int32_t dz = 0;
   const char *src = gTextEditor->buffer()->text();
   const char *text = src;
   for (;;) {
@@ -417,9 +440,17 @@ void saveFile(const char *fn)
     } else if (strncmp(src, "rStop ", 6)==0) {
       writeInt(f, 157); src+=6; skipEOL(src);
     } else if (strncmp(src, "spread ", 7)==0) {
-      writeInt(f, 158); src+=7; writeIntArg(f, src); skipEOL(src);
+      layerOffset.push_back((int32_t)ftell(f));
+      layerDz.push_back(dz);
+      writeInt(f, 158); src+=7; dz += writeIntArg(f, src); skipEOL(src);
     } else if (strncmp(src, "fire ", 5)==0) {
       writeInt(f, 1); src+=5; writeIntArg(f, src); skipEOL(src);
+    } else if (strncmp(src, "fireN ", 6)==0) {
+      writeInt(f, 2); src+=6; writeIntArg(f, src); skipComma(src); writeIntArg(f, src); skipEOL(src);
+    } else if (strncmp(src, "fireRepeat ", 11)==0) {
+      writeInt(f, 3); src+=11; writeIntArg(f, src); skipComma(src); writeIntArg(f, src); skipComma(src); writeIntArg(f, src); skipEOL(src);
+    } else if (strncmp(src, "skip ", 5)==0) {
+      writeInt(f, 4); src+=5; writeIntArg(f, src); skipEOL(src);
     } else if (strncmp(src, "fireNozzle ", 11)==0) {
       writeInt(f, 138); src+=11; writeIntArg(f, src); skipEOL(src);
     } else if (strncmp(src, "delay ", 6)==0) {
@@ -439,6 +470,15 @@ void saveFile(const char *fn)
       break;
     }
   }
+  // layer index, so that the printer can start at any layer
+  int32_t i, indexOffset = (int32_t)ftell(f);
+  writeInt(f, 131);
+  writeFixedInt(f, (int32_t)layerOffset.size());
+  for (i=0; i<(int32_t)layerOffset.size(); i++) {
+    writeFixedInt(f, layerOffset[i]);
+    writeFixedInt(f, layerDz[i]);
+  }
+  writeFixedInt(f, indexOffset);
   fclose(f);
   free((void*)text);
 }
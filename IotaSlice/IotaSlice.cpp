@@ -9,8 +9,6 @@
 #define M_MONKEY
 #undef M_DRAGON
 
-static int kNDrops = 10;
-
 /*
  
  Slicing Strategy:
@@ -112,6 +110,7 @@ static int kNDrops = 10;
 
 #include <FL/Fl.h>
 #include <FL/Fl_Button.h>
+#include <FL/Fl_File_Chooser.h>
 #include <FL/Fl_Gl_Window.h>
 #include <FL/Fl_Slider.h>
 #include <FL/gl.h>
@@ -134,629 +133,14 @@ static int kNDrops = 10;
 
 Fl_Slider *zSlider1, *zSlider2;
 
-ISMeshList gMeshList;
 ISMeshSlice gMeshSlice;
 
-GLUtesselator *gGluTess = 0;
 
 bool gShowSlice = false;
 int gWriteSliceNext = 0;
 
-FILE *gOutFile;
-
-// -----------------------------------------------------------------------------
-// Machine Parameters
-
-// ink head data
-const double gIotaXDpi = 96.0;            // targeted resolution in X direction
-const double gIotaYDpi = 96.0;            // ink head resolution in Y direction
-const double gIotaXDotsPmm = 96.0;        // same in metric
-const double gIotaYDotsPmm = 96.0;        // same in metric
-const int gIotaNozzles = 12;              // number of nozzles on cartridge
-                                          // TODO: this assumes a straigh vertical row of nozzles. Patterns must be implemented later
-
-// stepper motor data
-const double gIotaXStepsPmm = 10.0;       // x motion of carriage per step pulse
-const double gIotaYStepsPmm = 10.0;       // y motion of bridge per step pulse
-const double gIotaZ1StepsPmm = 10.0;      // Supply piston motion per step
-const double gIotaZ2StepsPmm = 10.0;      // Build piston motion per step
-const double gIotaRStepsPRound = 200.0;
-
-// carriage dimensions
-const double gIotaCarW = 30.0;
-const double gIotaCarH = 60.0;
-const double gIotaHeadX = 10.0;
-const double gIotaHeadY = 10.0;
-const double gIotaHeadW = 10.0;
-const double gIotaHeadH = 60.0;
-const double gIotaRollerX = 10.0;
-const double gIotaRollerY = 10.0;
-const double gIotaRollerW = 10.0;
-const double gIotaRollerH = 60.0;
-const double gIotaHeadParkX = 10.0;
-const double gIotaHeadParkY = 10.0;
-
-// printer dimensions
-const double gIotaPrinterX = -1.5;
-const double gIotaPrinterY = -1.5;
-const double gIotaPrinterW = 600.0;
-const double gIotaPrinterH = 800.0;
-const double gIotaSupplyBoxX = -1.5;
-const double gIotaSupplyBoxY = -1.5;
-const double gIotaSupplyBoxW = 600.0;
-const double gIotaSupplyBoxH = 800.0;
-const double gIotaSupplyBoxMinD = 0.0;
-const double gIotaSupplyBoxMaxD = 150.0;
-const double gIotaBuildBoxX = -1.5;
-const double gIotaBuildBoxY = -1.5;
-const double gIotaBuildBoxW = 600.0;
-const double gIotaBuildBoxH = 800.0;
-const double gIotaBuildBoxMinD = 0.0;
-const double gIotaBuildBoxMaxD = 150.0;
-
-// model
-const double gModelScale = 40.0;
-const double gMinimumShell = 4.0; // mm
-
-// -----------------------------------------------------------------------------
-
-void writeInt(FILE *f, int32_t x)
-{
-    uint8_t v;
-    // bits 34..28
-    if (x&(0xffffffff<<28)) {
-        v = ((x>>28) & 0x7f) | 0x80;
-        fputc(v, f);
-    }
-    // bits 27..21
-    if (x&(0xffffffff<<21)) {
-        v = ((x>>21) & 0x7f) | 0x80;
-        fputc(v, f);
-    }
-    // bits 20..14
-    if (x&(0xffffffff<<14)) {
-        v = ((x>>14) & 0x7f) | 0x80;
-        fputc(v, f);
-    }
-    // bits 13..7
-    if (x&(0xffffffff<<7)) {
-        v = ((x>>7) & 0x7f) | 0x80;
-        fputc(v, f);
-    }
-    // bits 6..0
-    v = x & 0x7f;
-    fputc(v, f);
-}
-
-// -----------------------------------------------------------------------------
-
-ISVec3::ISVec3()
-{
-    pV[0] = 0.0;
-    pV[1] = 0.0;
-    pV[2] = 0.0;
-}
-
-ISVec3::ISVec3(const ISVec3 &v)
-{
-    pV[0] = v.pV[0];
-    pV[1] = v.pV[1];
-    pV[2] = v.pV[2];
-}
-
-ISVec3::ISVec3(double *v)
-{
-    pV[0] = v[0];
-    pV[1] = v[1];
-    pV[2] = v[2];
-}
-
-ISVec3::ISVec3(float x, float y, float z)
-{
-    pV[0] = x;
-    pV[1] = y;
-    pV[2] = z;
-}
-
-void ISVec3::set(float x, float y, float z)
-{
-    pV[0] = x;
-    pV[1] = y;
-    pV[2] = z;
-}
-
-void ISVec3::read(float *v)
-{
-    pV[0] = v[0];
-    pV[1] = v[1];
-    pV[2] = v[2];
-}
-
-void ISVec3::read(double *v)
-{
-    pV[0] = v[0];
-    pV[1] = v[1];
-    pV[2] = v[2];
-}
-
-void ISVec3::write(double *v)
-{
-    v[0] = pV[0];
-    v[1] = pV[1];
-    v[2] = pV[2];
-}
-
-double ISVec3::normalize()
-{
-    double len = sqrt(pV[0]*pV[0]+pV[1]*pV[1]+pV[2]*pV[2]);
-    if (len==0.0) {
-        len = 1.0;
-    } else {
-        len = 1.0/len;
-    }
-    pV[0] *= len;
-    pV[1] *= len;
-    pV[2] *= len;
-    return len;
-}
-
-ISVec3& ISVec3::operator-=(const ISVec3 &v)
-{
-    pV[0] -= v.pV[0];
-    pV[1] -= v.pV[1];
-    pV[2] -= v.pV[2];
-    return *this;
-}
-
-ISVec3& ISVec3::operator+=(const ISVec3 &v)
-{
-    pV[0] += v.pV[0];
-    pV[1] += v.pV[1];
-    pV[2] += v.pV[2];
-    return *this;
-}
-
-ISVec3& ISVec3::operator*=(double n)
-{
-    pV[0] *= n;
-    pV[1] *= n;
-    pV[2] *= n;
-    return *this;
-}
-
-ISVec3& ISVec3::cross(const ISVec3 &b)
-{
-    ISVec3 a(*this);
-    pV[0] = a.pV[1]*b.pV[2] - a.pV[2]*b.pV[1];
-    pV[1] = a.pV[2]*b.pV[0] - a.pV[0]*b.pV[2];
-    pV[2] = a.pV[0]*b.pV[1] - a.pV[1]*b.pV[0];
-    return *this;
-}
-
-void ISVec3::zero()
-{
-    pV[0] = 0.0;
-    pV[1] = 0.0;
-    pV[2] = 0.0;
-}
-
-// -----------------------------------------------------------------------------
-
-ISVertex::ISVertex()
-{
-    pPosition.zero();
-    pNormal.zero();
-    pNNormal = 0;
-}
-
-ISVertex::ISVertex(const ISVertex *v)
-{
-    pPosition = v->pPosition;
-    pNormal = v->pNormal;
-    pNNormal = v->pNNormal;
-}
-
-void ISVertex::addNormal(const ISVec3 &v)
-{
-    ISVec3 vn(v);
-    vn.normalize();
-    pNormal += vn;
-    pNNormal++;
-}
-
-void ISVertex::averageNormal()
-{
-    if (pNNormal>0) {
-        double len = 1.0/pNNormal;
-        pNormal *= len;
-    }
-}
-
-void ISVertex::print()
-{
-    printf("v=[%g, %g, %g]\n", pPosition.x(), pPosition.y(), pPosition.z());
-}
-
 // -----------------------------------------------------------------------------
 
-ISEdge::ISEdge()
-{
-    pVertex[0] = 0L;
-    pVertex[1] = 0L;
-    pFace[0] = 0L;
-    pFace[1] = 0L;
-}
-
-ISVertex *ISEdge::vertex(int i, ISFace *f)
-{
-    if (pFace[0]==f) {
-        return pVertex[i];
-    } else if (pFace[1]==f) {
-        return pVertex[1-i];
-    } else {
-        puts("ERROR: vertex() - this edge is not associated with this face!");
-        return 0L;
-    }
-}
-
-ISVertex *ISEdge::findZ(double zMin)
-{
-    ISVertex *v0 = pVertex[0], *v1 = pVertex[1];
-    ISVec3 vd0(v0->pPosition);
-    bool retVec = false;
-    vd0 -= v1->pPosition;
-    double dzo = vd0.z(), dzn = zMin-v1->pPosition.z();
-    double m = dzn/dzo;  // TODO: division by zero should not be possible...
-    if (m>=0.0 && m<=1) retVec = true;
-    if (retVec) {
-        ISVertex *v2 = new ISVertex();
-        vd0 *= m;
-        vd0 += v1->pPosition;
-        v2->pPosition = vd0;
-        return v2;
-    } else {
-        return 0L;
-    }
-}
-
-ISFace *ISEdge::otherFace(ISFace *f)
-{
-    if (pFace[0]==f) {
-        return pFace[1];
-    } else if (pFace[1]==f) {
-        return pFace[0];
-    } else {
-        puts("ERROR: otherFace() - this edge is not associated with this face!");
-        return 0L;
-    }
-}
-
-int ISEdge::indexIn(ISFace *f)
-{
-    if (f->pEdge[0]==this) return 0;
-    if (f->pEdge[1]==this) return 1;
-    if (f->pEdge[2]==this) return 2;
-    puts("ERROR: indexIn() - this edge was not found with this face!");
-    return -1;
-}
-
-int ISEdge::nFaces()
-{
-    int n = 0;
-    if (pFace[0]) n++;
-    if (pFace[1]) n++;
-    return n;
-}
-
-// -----------------------------------------------------------------------------
-
-ISFace::ISFace()
-{
-    pVertex[0] = 0L;
-    pVertex[1] = 0L;
-    pVertex[2] = 0L;
-    pEdge[0] = 0L;
-    pEdge[1] = 0L;
-    pEdge[2] = 0L;
-    pNormal.zero();
-    pNNormal = 0;
-}
-
-void ISFace::rotateVertices()
-{
-    ISVertex *v = pVertex[0];
-    pVertex[0] = pVertex[1];
-    pVertex[1] = pVertex[2];
-    pVertex[2] = v;
-    ISEdge *e = pEdge[0];
-    pEdge[0] = pEdge[1];
-    pEdge[1] = pEdge[2];
-    pEdge[2] = e;
-}
-
-void ISFace::print()
-{
-    printf("Face: \n");
-    pVertex[0]->print();
-    pVertex[1]->print();
-    pVertex[2]->print();
-}
-
-int ISFace::pointsBelowZ(double zMin)
-{
-    double z0 = pVertex[0]->pPosition.z();
-    double z1 = pVertex[1]->pPosition.z();
-    double z2 = pVertex[2]->pPosition.z();
-    int n = (z0<zMin) + (z1<zMin) + (z2<zMin);
-    return n;
-}
-
-// -----------------------------------------------------------------------------
-
-ISMesh::ISMesh()
-{
-}
-
-void ISMesh::clear()
-{
-    int i, n = (int)edgeList.size();
-    for (i=0; i<n; i++) {
-        delete edgeList[i];
-    }
-    edgeList.clear();
-    n = (int)faceList.size();
-    for (i=0; i<n; i++) {
-        delete faceList[i];
-    }
-    faceList.clear();
-    n = (int)vertexList.size();
-    for (i=0; i<n; i++) {
-        delete vertexList[i];
-    }
-    vertexList.clear();
-}
-
-bool ISMesh::validate()
-{
-    if (faceList.size()>0 && edgeList.size()==0) {
-        puts("ERROR: empty edge list!");
-    }
-    int i, n = (int)edgeList.size();
-    for (i=0; i<n; i++) {
-        ISEdge *e = edgeList[i];
-        if (e) {
-            if (e->pFace[0]==0L) {
-                printf("ERROR: edge %d [%p] without face found!\n", i, e);
-            } else if (e->pFace[1]==0L) {
-                printf("ERROR: edge %d [%p] with single face found (hole in mesh)!\n", i, e);
-            }
-            if (e->pFace[0]) {
-                if (e->pFace[0]->pEdge[0]!=e && e->pFace[0]->pEdge[1]!=e && e->pFace[0]->pEdge[2]!=e) {
-                    printf("ERROR: face [%p] is not pointing back at edge %d [%p]!\n", e->pFace[0], i, e);
-                }
-            }
-            if (e->pFace[1]) {
-                if (e->pFace[1]->pEdge[0]!=e && e->pFace[1]->pEdge[1]!=e && e->pFace[1]->pEdge[2]!=e) {
-                    printf("ERROR: face [%p] is not pointing back at edge %d [%p]!\n", e->pFace[1], i, e);
-                }
-            }
-            if (e->pVertex[0]==0L || e->pVertex[1]==0L) {
-                printf("ERROR: edge %d [%p] missing a vertex reference!\n", i, e);
-            }
-        } else {
-            puts("ERROR: zero edge found!");
-        }
-    }
-    n = (int)faceList.size();
-    for (i=0; i<n; i++) {
-        ISFace *f = faceList[i];
-        if (f) {
-            if (f->pVertex[0]==0L || f->pVertex[1]==0L || f->pVertex[1]==0L) {
-                printf("ERROR: face %d has an empty vertex field.\n", i);
-            }
-            if (f->pEdge[0]==0L || f->pEdge[1]==0L || f->pEdge[1]==0L) {
-                printf("ERROR: face %d has an empty edge field.\n", i);
-            } else {
-                if (f->pEdge[0]->vertex(0, f)!=f->pVertex[0])
-                    printf("ERROR: face %d has an edge0/vertex0 missmatch.\n", i);
-                if (f->pEdge[0]->vertex(1, f)!=f->pVertex[1])
-                    printf("ERROR: face %d has an edge0/vertex1 missmatch.\n", i);
-                if (f->pEdge[1]->vertex(0, f)!=f->pVertex[1])
-                    printf("ERROR: face %d has an edge1/vertex1 missmatch.\n", i);
-                if (f->pEdge[1]->vertex(1, f)!=f->pVertex[2])
-                    printf("ERROR: face %d has an edge1/vertex2 missmatch.\n", i);
-                if (f->pEdge[2]->vertex(0, f)!=f->pVertex[2])
-                    printf("ERROR: face %d has an edge2/vertex2 missmatch.\n", i);
-                if (f->pEdge[2]->vertex(1, f)!=f->pVertex[0])
-                    printf("ERROR: face %d has an edge2/vertex0 missmatch.\n", i);
-                if (f->pEdge[0]->pFace[0]!=f && f->pEdge[0]->pFace[1]!=f)
-                    printf("ERROR: face %d edge0 does not point back at face.\n", i);
-                if (f->pEdge[1]->pFace[0]!=f && f->pEdge[1]->pFace[1]!=f)
-                    printf("ERROR: face %d edge1 does not point back at face.\n", i);
-                if (f->pEdge[2]->pFace[0]!=f && f->pEdge[2]->pFace[1]!=f)
-                    printf("ERROR: face %d edge2 does not point back at face.\n", i);
-            }
-        } else {
-            puts("ERROR: zero face found!");
-        }
-    }
-    return true;
-}
-
-/**
- This function finds edges that have only a single face associated.
- It then adds a face to this edge and the next edge without a second face.
- If three edges are connected and none has a second face, a new triangle
- will fill the hole.
- */
-void ISMesh::fixHoles()
-{
-    printf("Fixing holes...\n");
-#ifdef M_MONKEY
-    fixHole(edgeList[21]);
-#elif defined M_DRAGON
-    return;
-#endif
-    int i;
-    for (i=0; i<(int)edgeList.size(); i++) {
-        ISEdge *e = edgeList[i];
-        while ( e->nFaces()==1 ) // FIXME: make sure that this is not endless
-            fixHole(e);
-    }
-}
-
-void ISMesh::fixHole(ISEdge *e)
-{
-    printf("Fixing a hole...\n");
-    ISFace *fFix;
-    if (e->pFace[0])
-        fFix = e->pFace[0];
-    else
-        fFix = e->pFace[1];
-    // walk the fan to the left and find the next edge
-    ISFace *fLeft = fFix;
-    ISEdge *eLeft = e;
-    for (;;) {
-        int ix = eLeft->indexIn(fLeft);
-        eLeft = fLeft->pEdge[(ix+2)%3];
-        if (eLeft->nFaces()==1)
-            break;
-        fLeft = eLeft->otherFace(fLeft);
-    }
-    // walk the fan to the right and find the next edge
-    ISFace *fRight = fFix;
-    ISEdge *eRight = e;
-    for (;;) {
-        int ix = eRight->indexIn(fRight);
-        eRight = fRight->pEdge[(ix+1)%3];
-        if (eRight->nFaces()==1)
-            break;
-        fRight = eRight->otherFace(fRight);
-    }
-    // eLeft and eRight are the next connecting edges
-    // fLeft and fRight are the only connected faces
-    // fLeft and fRight can well be fFix
-    ISVertex *vLeft = eLeft->vertex(0, fLeft);
-    ISVertex *vRight = eRight->vertex(1, fRight);
-    if (eLeft==eRight) {
-        // this is a zero size hole: merge the edges
-        puts("ERROR: zero size hole!");
-    } else if ( vLeft==vRight ) {
-        // this triangle fill conpletely fill the hole
-        ISFace *fNew = new ISFace();
-        fNew->pVertex[0] = e->vertex(1, fFix);
-        fNew->pVertex[1] = e->vertex(0, fFix);
-        fNew->pVertex[2] = vLeft;
-        addFace(fNew);
-    } else if (fFix==fRight) {
-        if (fLeft==fRight) {
-            // we have a single triangle without any connections, delete?
-            ISFace *fNew = new ISFace();
-            fNew->pVertex[0] = fFix->pVertex[2];
-            fNew->pVertex[1] = fFix->pVertex[1];
-            fNew->pVertex[2] = fFix->pVertex[0];
-            addFace(fNew);
-        } else {
-            fixHole(eRight);
-        }
-    } else {
-        // add one more triangle to get closer to filling the hole
-        ISFace *fNew = new ISFace();
-        fNew->pVertex[0] = e->vertex(1, fFix);
-        fNew->pVertex[1] = e->vertex(0, fFix);
-        fNew->pVertex[2] = eRight->vertex(1, fRight);
-        addFace(fNew);
-    }
-}
-
-void ISMesh::addFace(ISFace *newFace)
-{
-    newFace->pEdge[0] = addEdge(newFace->pVertex[0], newFace->pVertex[1], newFace);
-    newFace->pEdge[1] = addEdge(newFace->pVertex[1], newFace->pVertex[2], newFace);
-    newFace->pEdge[2] = addEdge(newFace->pVertex[2], newFace->pVertex[0], newFace);
-    faceList.push_back(newFace);
-}
-
-ISEdge *ISMesh::addEdge(ISVertex *v0, ISVertex *v1, ISFace *face)
-{
-    ISEdge *isEdge = findEdge(v0, v1);
-    if (isEdge) {
-        isEdge->pFace[1] = face;
-    } else {
-        isEdge = new ISEdge();
-        isEdge->pVertex[0] = v0;
-        isEdge->pVertex[1] = v1;
-        isEdge->pFace[0] = face;
-        edgeList.push_back(isEdge);
-    }
-    return isEdge;
-}
-
-ISEdge *ISMesh::findEdge(ISVertex *v0, ISVertex *v1)
-{
-    int i, n = (int)edgeList.size();
-    for (i=0; i<n; i++) {
-        ISEdge *isEdge = edgeList.at(i);
-        ISVertex *ev0 = isEdge->pVertex[0];
-        ISVertex *ev1 = isEdge->pVertex[1];
-        if ((ev0==v0 && ev1==v1)||(ev0==v1 && ev1==v0))
-            return isEdge;
-    }
-    return 0;
-}
-
-void ISMesh::clearFaceNormals()
-{
-    int i, n = (int)faceList.size();
-    for (i=0; i<n; i++) {
-        ISFace *isFace = faceList.at(i);
-        isFace->pNNormal = 0;
-    }
-}
-
-void ISMesh::clearVertexNormals()
-{
-    int i, n = (int)vertexList.size();
-    for (i=0; i<n; i++) {
-        ISVertex *isVertex = vertexList.at(i);
-        isVertex->pNNormal = 0;
-    }
-}
-
-void ISMesh::calculateFaceNormals()
-{
-    int i, n = (int)faceList.size();
-    for (i=0; i<n; i++) {
-        ISFace *isFace = faceList.at(i);
-        ISVec3 p0(isFace->pVertex[0]->pPosition);
-        ISVec3 p1(isFace->pVertex[1]->pPosition);
-        ISVec3 p2(isFace->pVertex[2]->pPosition);
-        p1 -= p0;
-        p2 -= p0;
-        ISVec3 n = p1.cross(p2);
-        n.normalize();
-        isFace->pNormal = n;
-        isFace->pNNormal = 1;
-    }
-}
-
-void ISMesh::calculateVertexNormals()
-{
-    int i, n = (int)faceList.size();
-    for (i=0; i<n; i++) {
-        ISFace *isFace = faceList.at(i);
-        ISVec3 n(isFace->pNormal);
-        isFace->pVertex[0]->addNormal(n);
-        isFace->pVertex[1]->addNormal(n);
-        isFace->pVertex[2]->addNormal(n);
-    }
-    n = (int)vertexList.size();
-    for (i=0; i<n; i++) {
-        ISVertex *isVertex = vertexList.at(i);
-        isVertex->averageNormal();
-    }
-}
-
 void ISMesh::drawGouraud() {
     int i, j, n = (int)faceList.size();
     glColor3f(1.0f, 1.0f, 1.0f);
@@ -822,28 +206,6 @@ void ISMesh::drawEdges() {
     glEnd();
 }
 
-// -----------------------------------------------------------------------------
-
-
-ISMeshSlice::ISMeshSlice()
-{
-}
-
-ISMeshSlice::~ISMeshSlice()
-{
-    clear();
-}
-
-void ISMeshSlice::clear()
-{
-    int i, n = (int)lidEdgeList.size();
-    for (i=0; i<n; i++) {
-        delete lidEdgeList[i];
-    }
-    lidEdgeList.clear();
-    ISMesh::clear();
-}
-
 void ISMeshSlice::drawLidEdge()
 {
     int i, j, n = (int)lidEdgeList.size();
@@ -862,196 +224,6 @@ void ISMeshSlice::drawLidEdge()
 }
 
 
-int tessVertexCount = 0;
-ISVertex *tessV0, *tessV1, *tessV2;
-
-void tessBeginCallback(GLenum which)
-{
-    tessVertexCount = 0;
-}
-
-void tessEndCallback()
-{
-}
-
-void tessVertexCallback(GLvoid *vertex)
-{
-    if (tessVertexCount==0) {
-        tessV0 = (ISVertex*)vertex;
-        tessVertexCount = 1;
-    } else if (tessVertexCount==1) {
-        tessV1 = (ISVertex*)vertex;
-        tessVertexCount = 2;
-    } else {
-        tessV2 = (ISVertex*)vertex;
-        ISFace *f = new ISFace();
-        f->pVertex[0] = tessV0;
-        f->pVertex[1] = tessV1;
-        f->pVertex[2] = tessV2;
-        gMeshSlice.addFace(f);
-        tessVertexCount = 0;
-    }
-}
-
-void tessCombineCallback(GLdouble coords[3],
-                         ISVertex *vertex_data[4],
-                         GLfloat weight[4], ISVertex **dataOut )
-{
-    ISVertex *v = new ISVertex();
-    v->pPosition.read(coords);
-    gMeshSlice.vertexList.push_back(v);
-    *dataOut = v;
-}
-
-void tessEdgeFlagCallback(GLboolean flag)
-{
-}
-
-void tessErrorCallback(GLenum errorCode)
-{
-    const GLubyte *estring;
-    estring = gluErrorString(errorCode);
-    fprintf (stderr, "Tessellation Error: %s\n", estring);
-}
-
-void ISMeshSlice::tesselate()
-{
-    if (!gGluTess)
-        gGluTess = gluNewTess();
-    
-    gluTessCallback(gGluTess, GLU_TESS_VERTEX, (GLvoid (*) ()) &tessVertexCallback);
-    gluTessCallback(gGluTess, GLU_TESS_BEGIN, (GLvoid (*) ()) &tessBeginCallback);
-    gluTessCallback(gGluTess, GLU_TESS_END, (GLvoid (*) ()) &tessEndCallback);
-    gluTessCallback(gGluTess, GLU_TESS_ERROR, (GLvoid (*) ()) &tessErrorCallback);
-    gluTessCallback(gGluTess, GLU_TESS_COMBINE, (GLvoid (*) ()) &tessCombineCallback);
-    gluTessCallback(gGluTess, GLU_TESS_EDGE_FLAG, (GLvoid (*) ()) &tessEdgeFlagCallback);
-    
-    gluTessProperty(gGluTess, GLU_TESS_WINDING_RULE, GLU_TESS_WINDING_POSITIVE);
-    
-    int i, n = (int)lidEdgeList.size();
-    tessVertexCount = 0;
-    gluTessBeginPolygon(gGluTess, this);
-    gluTessBeginContour(gGluTess);
-    for (i=0; i<n; i++) {
-        ISEdge *e = lidEdgeList[i];
-        if (e==NULL) {
-            gluTessEndContour(gGluTess);
-            gluTessBeginContour(gGluTess);
-        } else {
-            gluTessVertex(gGluTess, e->pVertex[0]->pPosition.dataPointer(), e->pVertex[0]);
-        }
-    }
-    gluTessEndContour(gGluTess);
-    gluTessEndPolygon(gGluTess);
-}
-
-
-/*
- Create the edge that cuts this triangle in half.
- 
- The first point is know to be on the z slice. The second edge that crosses
- z is found and the point of intersection is calculated. Then an edge is
- created that splits the face on the z plane.
- 
- \param isFace the face that is split in two; the face must cross zMin
- \param vCutA the first point on zMin along the first edge
- \param edgeIndex the index of the first edge that crosses zMin
- \param zMin slice on this z plane
- */
-void ISMeshSlice::addNextLidVertex(ISFacePtr &isFace, ISVertexPtr &vCutA, int &edgeIndex, double zMin)
-{
-    // faces are always clockwise
-    ISVertex *vOpp = isFace->pVertex[(edgeIndex+2)%3];
-    int newIndex;
-    if (vOpp->pPosition.z()<zMin) {
-        newIndex = (edgeIndex+1)%3;
-    } else {
-        newIndex = (edgeIndex+2)%3;
-    }
-    ISEdge *eCutB = isFace->pEdge[newIndex];
-    ISVertex *vCutB = eCutB->findZ(zMin);
-    if (!vCutB) {
-        puts("ERROR: addNextLidVertex failed, no Z point found!");
-    }
-    vertexList.push_back(vCutB);
-    ISEdge *lidEdge = new ISEdge();
-    lidEdge->pVertex[0] = vCutA;
-    lidEdge->pVertex[1] = vCutB;
-    lidEdgeList.push_back(lidEdge);
-    
-    vCutA = vCutB;
-    isFace = eCutB->otherFace(isFace);
-    edgeIndex = eCutB->indexIn(isFace);
-}
-
-/*
- Create the edge that cuts this triangle in half.
- 
- The first point is know to be on the z slice. The second edge that crosses
- z is found and the point of intersection is calculated. Then an edge is
- created that splits the face on the z plane.
- 
- \param isFace the face that is split in two; the face must cross zMin
- \param vCutA the first point on zMin along the first edge
- \param edgeIndex the index of the first edge that crosses zMin
- \param zMin slice on this z plane
- */
-void ISMeshSlice::addFirstLidVertex(ISFace *isFace, double zMin)
-{
-    ISFace *firstFace = isFace;
-    // find first edge that crosses zMin
-    int edgeIndex = -1;
-    if (isFace->pVertex[0]->pPosition.z()<zMin && isFace->pVertex[1]->pPosition.z()>=zMin) edgeIndex = 0;
-    if (isFace->pVertex[1]->pPosition.z()<zMin && isFace->pVertex[2]->pPosition.z()>=zMin) edgeIndex = 1;
-    if (isFace->pVertex[2]->pPosition.z()<zMin && isFace->pVertex[0]->pPosition.z()>=zMin) edgeIndex = 2;
-    if (edgeIndex==-1) {
-        puts("ERROR: addFirstLidVertex failed, not crossing zMin!");
-    }
-    ISVertex *vCutA = isFace->pEdge[edgeIndex]->findZ(zMin);
-    if (!vCutA) {
-        puts("ERROR: addFirstLidVertex failed, no Z point found!");
-    }
-    vertexList.push_back(vCutA);
-    //  addNextLidVertex(isFace, vCutA, edgeIndex, zMin);
-    int cc = 0;
-    for (;;) {
-        addNextLidVertex(isFace, vCutA, edgeIndex, zMin);
-        cc++;
-        if (isFace->pUsed)
-            break;
-        isFace->pUsed = true;
-    }
-    printf("%d edges linked\n", cc);
-    if (firstFace==isFace) {
-        puts("It's a loop!");
-    } else {
-        puts("It's NOT a loop!");
-    }
-    lidEdgeList.push_back(0L);
-}
-
-void ISMeshSlice::addZSlice(const ISMesh &m, double zMin)
-{
-    int i, n = (int)m.faceList.size();
-    for (i = 0; i < n; i++) {
-        m.faceList[i]->pUsed = false;
-    }
-    for (i = 0; i < n; i++) {
-        ISFace *isFace = m.faceList[i];
-        if (isFace->pUsed) continue;
-        isFace->pUsed = true;
-        int nBelow = isFace->pointsBelowZ(zMin);
-        if (nBelow==0) {
-            // do nothing
-        } else if (nBelow==1) {
-            addFirstLidVertex(isFace, zMin);
-        } else if (nBelow==2) {
-            addFirstLidVertex(isFace, zMin);
-        } else if (nBelow==3) {
-            // do nothing
-        }
-    }
-}
 
 // -----------------------------------------------------------------------------
 
@@ -1233,10 +405,7 @@ public:
         }
         glPopMatrix();
         
-        if (gWriteSliceNext==1) {
-            gWriteSliceNext = 0;
-            writeSlice();
-        } else if (gWriteSliceNext==2) {
+        if (gWriteSliceNext==2) {
             gWriteSliceNext = 0;
             writePrnSlice();
         }
@@ -1251,83 +420,6 @@ public:
         sprintf(buf, "%.4gmm thick", z2); gl_draw(buf, 10, 20);
     }
     
-    void writeSlice(int nDrops = kNDrops, int interleave=4) {
-        printf("# slice at %gmm\n", zSlider1->value());
-        // 500 high at 12 pixels = 41 swashes.
-        // 500 high at 12 pixels, interleave 4 = 166 swashes.
-        int incr = 12/interleave;
-        int x, i, n = (h()-11)/incr, ww = w(), row;
-        for (i=0; i<n; i++) {
-            int nLeft = 0, nFill = 0, nRight = 0;
-            printf("Swash %3d: ", i);
-            uint32_t *buf = (uint32_t*)malloc(ww*12*4);
-            glReadPixels(0, i*incr, ww, 12, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV, buf);
-            // find the first pixel
-            for (x=0; x<ww; x++) {
-                for (row=0; row<12; row++) {
-                    if (buf[x+row*ww]!=0) break;
-                }
-                if (row<12) break;
-            }
-            if (x<ww) {
-                nLeft = x;
-                for (x=ww-1; x>nLeft; x--) {
-                    for (row=0; row<12; row++) {
-                        if (buf[x+row*ww]!=0) break;
-                    }
-                    if (row<12) break;
-                }
-                nRight = ww-x;
-                nFill = ww-nLeft-nRight;
-                printf("%d / %d /%d", nLeft, nFill, nRight);
-                //fprintf(f, "# swash %d\n", i);
-#if 0
-                int rpt;
-                for (rpt = 0; rpt<1; rpt++) {
-                    // yGoto
-                    writeInt(gOutFile, 147);
-                    writeInt(gOutFile, 25536+425*i); // swash height (428)
-                                                     // xGoto
-                    writeInt(gOutFile, 144);
-                    writeInt(gOutFile, 100+36*nLeft); // first pixel
-                    for (x=nLeft; x<nLeft+nFill; x++) {
-                        uint32_t v = 0;
-                        for (row=0; row<12; row++) {
-                            v = v<<1;
-                            if (buf[x+row*ww]!=0) v |= 1;
-                        }
-                        // fire pattern
-                        writeInt(gOutFile, 1);
-                        writeInt(gOutFile, v);
-                    }
-                }
-#else
-                // yGoto
-                writeInt(gOutFile, 147);
-                writeInt(gOutFile, 22000+425*i*incr/12); // swash height (428)
-                                                         // xGoto
-                writeInt(gOutFile, 144);
-                writeInt(gOutFile, 100+36*nLeft); // first pixel
-                for (x=nLeft; x<nLeft+nFill; x++) {
-                    uint32_t v = 0;
-                    for (row=0; row<12; row++) {
-                        v = v<<1;
-                        if (buf[x+row*ww]!=0) v |= 1;
-                    }
-                    // fire pattern times n
-                    writeInt(gOutFile, 2);
-                    writeInt(gOutFile, v);
-                    writeInt(gOutFile, nDrops);
-                }
-#endif
-            } else {
-                printf("empty");
-            }
-            free(buf);
-            printf("\n");
-        }
-    }
-    
     /*
      720 dpi
      1440 dpi
@@ -1439,7 +531,7 @@ void load3ds(Lib3dsFile *f, Lib3dsMeshInstanceNode *node) {
     {
         int i;
         for (i = 0; i < mesh->nvertices; ++i) {
-            ISVertex *isPoint = new ISVertex();
+            ISVertex *isPoint = new (isMesh->arena) ISVertex();
             isPoint->pPosition.read(mesh->vertices[i]);
             minX = min(minX, isPoint->pPosition.x());
             maxX = max(maxX, isPoint->pPosition.x());
@@ -1511,7 +603,7 @@ void load3ds(Lib3dsFile *f, Lib3dsMeshInstanceNode *node) {
             //      }
             //      fprintf(o, "f ");
             //      for (j = 0; j < 3; ++j) {
-            ISFace *isFace = new ISFace();
+            ISFace *isFace = new (isMesh->arena) ISFace();
             isFace->pVertex[0] = isMesh->vertexList[mesh->faces[i].index[0]];
             isFace->pVertex[1] = isMesh->vertexList[mesh->faces[i].index[1]];
             isFace->pVertex[2] = isMesh->vertexList[mesh->faces[i].index[2]];
@@ -1552,113 +644,15 @@ void load3ds(Lib3dsFile *f, Lib3dsMeshInstanceNode *node) {
     // TODO: fix seams
     // TODO: fix zero size holes
     // TODO: fix degenrate triangles
+#ifdef M_MONKEY
+    isMesh->fixHole(isMesh->edgeList[21]);
+#endif
     isMesh->fixHoles();
     isMesh->validate();
     
     isMesh->clearNormals();
     isMesh->calculateNormals();
-}
-
-
-int getShort(FILE *f) {
-    int ret = 0;
-    ret |= fgetc(f);
-    ret |= fgetc(f)<<8;
-    return ret;
-}
-
-int getInt(FILE *f) {
-    int ret = 0;
-    ret |= fgetc(f);
-    ret |= fgetc(f)<<8;
-    ret |= fgetc(f)<<16;
-    ret |= fgetc(f)<<24;
-    return ret;
-}
-
-float getFloat(FILE *f) {
-    float ret;
-    fread(&ret, 4, 1, f);
-    return ret;
-}
-
-int addPoint(ISMesh *isMesh, float x, float y, float z)
-{
-    int i, n = (int)isMesh->vertexList.size();
-    for (i = 0; i < n; ++i) {
-        ISVertex *v = isMesh->vertexList[i];
-        if (   v->pPosition.x()==x
-            && v->pPosition.y()==y
-            && v->pPosition.z()==z)
-        {
-            return i;
-        }
-    }
-    ISVertex *v = new ISVertex();
-    v->pPosition.set(x, y, z);
-    isMesh->vertexList.push_back(v);
-    return n;
-}
-
-/**
- Load a single node from a binary stl file.
- */
-void loadStl(const char *filename) {
-    int i;
-    
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
-        fprintf(stderr, "ERROR openening file!\n");
-        return;
-    }
-    fseek(f, 0x50, SEEK_SET);
-    ISMesh *isMesh = new ISMesh();
-    gMeshList.push_back(isMesh);
-    
-    int nFaces = getInt(f);
-    for (i=0; i<nFaces; i++) {
-        float x, y, z;
-        int p1, p2, p3;
-        // face normal
-        getFloat(f);
-        getFloat(f);
-        getFloat(f);
-        // point 1
-        x = getFloat(f);
-        y = getFloat(f);
-        z = getFloat(f);
-        p1 = addPoint(isMesh, x, y, z);
-        // point 2
-        x = getFloat(f);
-        y = getFloat(f);
-        z = getFloat(f);
-        p2 = addPoint(isMesh, x, y, z);
-        // point 3
-        x = getFloat(f);
-        y = getFloat(f);
-        z = getFloat(f);
-        p3 = addPoint(isMesh, x, y, z);
-        // add face
-        ISFace *isFace = new ISFace();
-        isFace->pVertex[0] = isMesh->vertexList[p1];
-        isFace->pVertex[1] = isMesh->vertexList[p2];
-        isFace->pVertex[2] = isMesh->vertexList[p3];
-        isMesh->addFace(isFace);
-        // color
-        getShort(f);
-    }
-    
-    isMesh->validate();
-    // TODO: fix seams
-    // TODO: fix zero size holes
-    // TODO: fix degenrate triangles
-    isMesh->fixHoles();
-    isMesh->validate();
-    
-    isMesh->clearNormals();
-    isMesh->calculateNormals();
-    
-    fclose(f);
+    isMesh->buildZIndex();
 }
 
 
@@ -1711,52 +705,60 @@ static void z2ChangedCB(Fl_Widget*, void*)
     glView->redraw();
 }
 
+/**
+ Show the progress of writing a .3dp file.
+ 
+ Only redraw here. Handling events would let the user load another model
+ while the slicing threads still read the meshes.
+ */
+static void writeProgressCB(ISMeshSlice &slice, int layer, double z, void*)
+{
+    zSlider1->value(z);
+    Fl::flush();
+}
+
+/**
+ Render a layer that was sliced by the sweep and write it to a .prn file.
+ */
+static void writePrnLayerCB(ISMeshSlice &slice, int layer, double z, void*)
+{
+    // render the layer
+    slice.tesselate();
+    zSlider1->value(z);
+    gShowSlice = true;
+    gWriteSliceNext = 2;
+    glView->redraw();
+    glView->flush();
+    Fl::flush();
+}
+
 static void writeSliceCB(Fl_Widget*, void*)
 {
-    double z;
 #ifdef M_MONKEY
     double firstLayer  = -8.8;
     double lastLayer   =  9.0;
     double layerHeight =  0.1;
-    gOutFile = fopen("/Users/matt/monkey.3dp", "wb");
+    const char *filename = "/Users/matt/monkey.3dp";
 #elif defined M_DRAGON
     double firstLayer  = -20.0;
     double lastLayer   =  14.0;
     double layerHeight =   0.1;
-    gOutFile = fopen("/Users/matt/dragon.3dp", "wb");
+    const char *filename = "/Users/matt/dragon.3dp";
 #endif
-    // header
-    writeInt(gOutFile, 23);  // Magic
-    writeInt(gOutFile, 3);
-    writeInt(gOutFile, 2013);
-    writeInt(gOutFile, 1);   // File Version
-    writeInt(gOutFile, 159); // total number of layers
-    writeInt(gOutFile,  (lastLayer-firstLayer)/layerHeight );
-    
-    for (z=firstLayer; z<=lastLayer; z+=layerHeight) {
-        // spread powder
-        writeInt(gOutFile, 158);
-        writeInt(gOutFile,  10); // spread 0.1mm layers
-                                 // render the layer
-        zSlider1->value(z);
-        zSlider1->do_callback();
-        gWriteSliceNext = 1;
-        glView->redraw();
-        glView->flush();
-        Fl::flush();
+    filename = fl_file_chooser("Write .3dp File", "*.3dp", filename);
+    if (!filename) return;
+    ISSlicer slicer;
+    int i, n = (int)gMeshList.size();
+    for (i=0; i<n; i++) {
+        slicer.addMesh(gMeshList[i]);
     }
-    //  writeInt(gOutFile, 158);
-    //  writeInt(gOutFile,  25); // spread 0.25mm layers
-    //  writeInt(gOutFile, 158);
-    //  writeInt(gOutFile,  25); // spread 0.25mm layers
-    fclose(gOutFile);
-    fprintf(stderr, "/Users/matt/monkey.3dp");
+    write3dp(filename, slicer, firstLayer, lastLayer, layerHeight, writeProgressCB);
+    fprintf(stderr, "%s", filename);
 }
 
 
 static void writePrnSliceCB(Fl_Widget*, void*)
 {
-    double z;
 #ifdef M_MONKEY
     double firstLayer  = -8.8;
     double lastLayer   =  9.0;
@@ -1767,20 +769,12 @@ static void writePrnSliceCB(Fl_Widget*, void*)
     double layerHeight =   0.1;
 #endif
     
-    for (z=firstLayer; z<=lastLayer; z+=layerHeight) {
-        zSlider1->value(z);
-        zSlider1->do_callback();
-        gWriteSliceNext = 2;
-        glView->redraw();
-        glView->flush();
-        Fl::flush();
+    ISSlicer slicer;
+    int i, n = (int)gMeshList.size();
+    for (i=0; i<n; i++) {
+        slicer.addMesh(gMeshList[i]);
     }
-    //  writeInt(gOutFile, 158);
-    //  writeInt(gOutFile,  25); // spread 0.25mm layers
-    //  writeInt(gOutFile, 158);
-    //  writeInt(gOutFile,  25); // spread 0.25mm layers
-    fclose(gOutFile);
-    fprintf(stderr, "/Users/matt/monkey.3dp");
+    slicer.sweep(gMeshSlice, firstLayer, lastLayer, layerHeight, writePrnLayerCB);
 }
 
 
@@ -10,12 +10,117 @@
 #define __IotaSlice__IotaSlice__
 
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <vector>
+#include <unordered_map>
+#include <utility>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// -----------------------------------------------------------------------------
+// Machine Parameters
+
+// ink head data
+const double gIotaXDpi = 96.0;            // targeted resolution in X direction
+const double gIotaYDpi = 96.0;            // ink head resolution in Y direction
+const double gIotaXDotsPmm = 96.0;        // same in metric
+const double gIotaYDotsPmm = 96.0;        // same in metric
+const int gIotaNozzles = 12;              // number of nozzles on cartridge
+                                          // TODO: this assumes a straigh vertical row of nozzles. Patterns must be implemented later
+
+// stepper motor data
+const double gIotaXStepsPmm = 10.0;       // x motion of carriage per step pulse
+const double gIotaYStepsPmm = 10.0;       // y motion of bridge per step pulse
+const double gIotaZ1StepsPmm = 10.0;      // Supply piston motion per step
+const double gIotaZ2StepsPmm = 10.0;      // Build piston motion per step
+const double gIotaRStepsPRound = 200.0;
+
+// carriage dimensions
+const double gIotaCarW = 30.0;
+const double gIotaCarH = 60.0;
+const double gIotaHeadX = 10.0;
+const double gIotaHeadY = 10.0;
+const double gIotaHeadW = 10.0;
+const double gIotaHeadH = 60.0;
+const double gIotaRollerX = 10.0;
+const double gIotaRollerY = 10.0;
+const double gIotaRollerW = 10.0;
+const double gIotaRollerH = 60.0;
+const double gIotaHeadParkX = 10.0;
+const double gIotaHeadParkY = 10.0;
+
+// printer dimensions
+const double gIotaPrinterX = -1.5;
+const double gIotaPrinterY = -1.5;
+const double gIotaPrinterW = 600.0;
+const double gIotaPrinterH = 800.0;
+const double gIotaSupplyBoxX = -1.5;
+const double gIotaSupplyBoxY = -1.5;
+const double gIotaSupplyBoxW = 600.0;
+const double gIotaSupplyBoxH = 800.0;
+const double gIotaSupplyBoxMinD = 0.0;
+const double gIotaSupplyBoxMaxD = 150.0;
+const double gIotaBuildBoxX = -1.5;
+const double gIotaBuildBoxY = -1.5;
+const double gIotaBuildBoxW = 600.0;
+const double gIotaBuildBoxH = 800.0;
+const double gIotaBuildBoxMinD = 0.0;
+const double gIotaBuildBoxMaxD = 150.0;
+
+// slicing
+const int kNDrops = 10;                  // drops fired per pattern
+
+// model
+const double gModelScale = 40.0;
+const double gMinimumShell = 4.0; // mm
+const double gWeldEpsilon = 0.0001;       // merge STL points closer than this
+
+// rasterized layer area, same as the 500x500 pixel preview
+const double gLayerX = -66.1;             // left edge in mm
+const double gLayerY = -66.1;             // bottom edge in mm
+const int gLayerW = 500;                  // width in pixels at gIotaXDpi
+const int gLayerH = 500;                  // height in pixels at gIotaYDpi
+
 
 class ISVertex; 
 class ISEdge;
 class ISFace;
 class ISMesh;
+class ISHalfEdgeMesh;
+struct GLUtesselator;
+
+
+/**
+ A simple arena allocator.
+ 
+ Memory is handed out by moving a pointer through large blocks. Single
+ allocations are never freed; clear() releases all blocks at once, and
+ reset() keeps the blocks around to be filled again. Only objects that do
+ not need their destructor called may be created here.
+ */
+class ISArena
+{
+public:
+  ISArena(size_t blockSize=256*1024);
+  ~ISArena();
+  void *allocate(size_t size);
+  void reset();
+  void clear();
+  size_t pBlockSize;
+  std::vector<char*> pBlockList;
+  std::vector<size_t> pBlockSizeList;
+  int pBlock;
+  char *pNext, *pEnd;
+private:
+  ISArena(const ISArena&);
+  ISArena &operator=(const ISArena&);
+};
+
+inline void *operator new(size_t size, ISArena &arena) { return arena.allocate(size); }
+inline void operator delete(void*, ISArena&) { }
 
 
 class ISVec3
@@ -35,9 +140,9 @@ public:
   void write(double*);
   void read(float*);
   void read(double*);
-  double x() { return pV[0]; }
-  double y() { return pV[1]; }
-  double z() { return pV[2]; }
+  double x() const { return pV[0]; }
+  double y() const { return pV[1]; }
+  double z() const { return pV[2]; }
   void set(float, float, float);
   double pV[3];
 };
@@ -65,7 +170,7 @@ class ISEdge
 {
 public:
   ISEdge();
-  ISVertex *findZ(double);
+  ISVertex *findZ(double, ISArena&);
   ISVertex *vertex(int i, ISFace *f);
   ISFace *otherFace(ISFace *);
   ISVertex *otherVertex(ISVertex*);
@@ -77,6 +182,26 @@ public:
 
 typedef std::vector<ISEdge*> ISEdgeList;
 
+/**
+ Hash table of edges, keyed by the two vertices of an edge in any order.
+ 
+ The table uses open addressing and stores nothing but edge pointers, so
+ adding an edge never allocates memory on its own.
+ */
+class ISEdgeIndex
+{
+public:
+  ISEdgeIndex();
+  void clear();
+  void reserve(size_t n);
+  ISEdge *find(ISVertex*, ISVertex*) const;
+  void insert(ISEdge*);
+  void reset();
+  static size_t hash(ISVertex*, ISVertex*);
+  std::vector<ISEdge*> pSlot;
+  size_t pSize;
+};
+
 class ISFace
 {
 public:
@@ -89,12 +214,45 @@ public:
   ISEdge *pEdge[3];
   ISVec3 pNormal;
   int pNNormal;
-  bool pUsed;
+  uint32_t pIndex;
 };
 
 typedef ISFace *ISFacePtr;
 typedef std::vector<ISFace*> ISFaceList;
 
+struct ISFaceZNode
+{
+  double center;
+  uint32_t first, n;
+  int left, right;
+};
+
+/**
+ Interval tree over the z range of all faces of a mesh.
+ 
+ Every node stores the faces whose z range contains its center twice: once
+ sorted by their lowest z, and once sorted by their highest z, so a query
+ stops scanning a node at the first face that does not reach z. Faces that
+ lie completely below or above the center go into the left or right
+ subtree.
+ */
+class ISFaceZIndex
+{
+public:
+  ISFaceZIndex();
+  void clear();
+  void build(const ISMesh&);
+  void build(const ISHalfEdgeMesh&);
+  void build(const std::vector<double> &zMin, const std::vector<double> &zMax);
+  void findFaces(double z, std::vector<uint32_t> &faces) const;
+  uint32_t nFaces() const { return pNFaces; }
+  int buildNode(std::vector<uint32_t> &faces, const std::vector<double> &zMin, const std::vector<double> &zMax);
+  std::vector<ISFaceZNode> pNodeList;
+  std::vector<uint32_t> pByZMin, pByZMax;
+  std::vector<double> pZMin, pZMax;
+  uint32_t pNFaces;
+};
+
 class ISMesh
 {
 public:
@@ -117,13 +275,159 @@ public:
   void fixHole(ISEdge*);
   ISEdge *findEdge(ISVertex*, ISVertex*);
   ISEdge *addEdge(ISVertex*, ISVertex*, ISFace*);
+  void buildZIndex() { zIndex.build(*this); }
+  size_t memoryUsage() const;
   ISVertexList vertexList;
   ISEdgeList edgeList;
+  ISEdgeIndex edgeIndex;
   ISFaceList faceList;
+  ISFaceZIndex zIndex;
+  ISArena arena;
 };
 
 typedef std::vector<ISMesh*> ISMeshList;
 
+const uint32_t kISNone = 0xffffffff;
+
+/**
+ A compact triangle mesh using 32-bit indices instead of pointers.
+ 
+ Positions and normals are stored as separate float arrays. Face f owns the
+ half-edges 3f, 3f+1 and 3f+2, and half-edge 3f+i runs from corner i to
+ corner i+1 of the face, just like ISFace::pEdge[i]. Every half-edge stores
+ its start vertex and its twin in the neighboring face, or kISNone if it
+ borders a hole.
+ */
+class ISHalfEdgeMesh
+{
+public:
+  ISHalfEdgeMesh();
+  void clear();
+  void set(const ISMesh&);
+  uint32_t addVertex(float x, float y, float z);
+  uint32_t addFace(uint32_t a, uint32_t b, uint32_t c);
+  void linkHalfEdges();
+  uint32_t nVertices() const { return (uint32_t)pX.size(); }
+  uint32_t nFaces() const { return (uint32_t)pHEVertex.size()/3; }
+  static uint32_t face(uint32_t h) { return h/3; }
+  static uint32_t next(uint32_t h) { return (h%3==2) ? h-2 : h+1; }
+  static uint32_t prev(uint32_t h) { return (h%3==0) ? h+2 : h-1; }
+  uint32_t vertex(uint32_t h) const { return pHEVertex[h]; }
+  uint32_t twin(uint32_t h) const { return pHETwin[h]; }
+  uint32_t nextBorder(uint32_t h) const;
+  void clearNormals();
+  void calculateFaceNormals();
+  void calculateVertexNormals();
+  void calculateNormals() { calculateFaceNormals(); calculateVertexNormals(); }
+  void fixHoles();
+  void buildZIndex() { zIndex.build(*this); }
+  size_t memoryUsage() const;
+  std::vector<float> pX, pY, pZ;
+  std::vector<float> pNX, pNY, pNZ;
+  std::vector<float> pFaceNX, pFaceNY, pFaceNZ;
+  std::vector<uint32_t> pHEVertex;
+  std::vector<uint32_t> pHETwin;
+  ISFaceZIndex zIndex;
+};
+
+/**
+ A cell in the spatial hash of the vertex welder.
+ */
+struct ISWeldCell
+{
+  int64_t x, y, z;
+  bool operator==(const ISWeldCell &c) const { return x==c.x && y==c.y && z==c.z; }
+};
+
+struct ISWeldCellHash
+{
+  size_t operator()(const ISWeldCell &c) const {
+    return (size_t)(c.x*73856093) ^ (size_t)(c.y*19349663) ^ (size_t)(c.z*83492791);
+  }
+};
+
+typedef std::unordered_map<ISWeldCell, int, ISWeldCellHash> ISWeldCellMap;
+
+/**
+ Add vertices to a mesh, merging points that are closer than epsilon.
+ 
+ Points are sorted into a grid with a cell size of epsilon, so that every
+ new point only needs to be compared to the points in the 27 neighboring
+ cells. An epsilon of 0 merges exact duplicates only.
+ */
+class ISVertexWelder
+{
+public:
+  ISVertexWelder(ISMesh *mesh, double epsilon=0.0);
+  void reserve(int n);
+  int addPoint(float x, float y, float z);
+  ISWeldCell cell(float x, float y, float z);
+  int findPoint(const ISWeldCell &c, float x, float y, float z);
+  void link(const ISWeldCell &c, int ix);
+  ISMesh *pMesh;
+  double pEpsilon;
+  ISWeldCellMap pCellHead;
+  std::vector<int> pNext;
+};
+
+struct ISRasterEdge
+{
+  double x, y, slope;
+  int first, last, dir;
+};
+
+struct ISRasterCrossing
+{
+  double x;
+  int dir;
+  bool operator<(const ISRasterCrossing &c) const { return x<c.x; }
+};
+
+/**
+ A layer image with one bit per pixel, stored the way the print head needs it.
+ 
+ Every column is a bit plane of its own: all pixels of one column are packed
+ into 32 bit words, from the top row of the build area in bit 0 down to the
+ bottom row. The pixels under the nozzles of a swath are then a contiguous
+ bit field, so a nozzle word is read with a shift and a mask.
+ 
+ Spans are filled row by row into a band of 32 rows, which is then turned
+ into column words with transposeBits().
+ */
+class ISLayerBitmap
+{
+public:
+  ISLayerBitmap();
+  void setup(double x, double y, int w, int h, double xDpi, double yDpi);
+  void clear();
+  bool pixel(int x, int y) const {
+    int b = pHeight-1-y;
+    return (pBits[(size_t)x*pWordsPerColumn+(b>>5)]>>(b&31))&1;
+  }
+  /**
+   Return the pixels of column x in rows y up to y+n-1 as a nozzle word.
+   Row y is in the highest bit, row y+n-1 in bit 0. n can be 1 to 32.
+   */
+  uint32_t nozzles(int x, int y, int n) const {
+    int b = pHeight-y-n;
+    const uint32_t *col = &pBits[(size_t)x*pWordsPerColumn+(b>>5)];
+    uint64_t v = col[0];
+    if ((b>>5)+1<pWordsPerColumn) v |= (uint64_t)col[1]<<32;
+    return (uint32_t)(v>>(b&31)) & (0xffffffffU>>(32-n));
+  }
+  void fillSpan(int y, int x0, int x1);
+  void flushBand();
+  void addEdge(const ISVec3 &a, const ISVec3 &b);
+  void rasterize(const ISEdgeList &lidEdgeList);
+  double pX, pY, pXScale, pYScale;
+  int pWidth, pHeight, pWordsPerColumn, pWordsPerRow, pBandWord;
+  std::vector<uint32_t> pBits;
+  std::vector<uint32_t> pBand;
+  std::vector<ISRasterEdge> pEdgeList;
+  std::vector<uint32_t> pActive;
+  std::vector<ISRasterCrossing> pCrossing;
+};
+
 class ISMeshSlice : public ISMesh
 {
 public:
@@ -133,10 +437,133 @@ public:
   void drawLidEdge();
   void tesselate();
   void addZSlice(const ISMesh&, double);
+  void addZSlice(const ISMesh&, double, const std::vector<uint32_t> &crossingFaces);
+  void addZSlice(const ISHalfEdgeMesh&, double);
+  void addZSlice(const ISHalfEdgeMesh&, double, const std::vector<uint32_t> &crossingFaces);
   void addFirstLidVertex(ISFace *isFace, double zMin);
   void addNextLidVertex(ISFacePtr &isFace, ISVertexPtr &vCutA, int &edgeIndex, double zMin);
+  void nextStamp(size_t nFaces);
+  bool useFace(uint32_t f);
+  bool useFace(const ISFace *f) { return useFace(f->pIndex); }
+  void tessVertex(ISVertex *v);
   ISEdgeList lidEdgeList;
+  std::vector<uint32_t> crossingFaceList;
+  std::vector<unsigned char> layerData;
+  ISLayerBitmap bitmap;
+  std::vector<uint32_t> pFaceStamp;
+  uint32_t pStamp;
+  int pNOpenContours;
+  GLUtesselator *pTess;
+  int pTessVertexCount;
+  ISVertex *pTessV[2];
+private:
+  ISMeshSlice(const ISMeshSlice&);
+  ISMeshSlice &operator=(const ISMeshSlice&);
+};
+
+typedef void (ISSliceCallback)(ISMeshSlice &slice, int layer, double z, void *userData);
+
+/**
+ Per mesh state of the slicer sweep. Either mesh or heMesh is set.
+ */
+struct ISSweepMesh
+{
+  const ISMesh *mesh;
+  const ISHalfEdgeMesh *heMesh;
+  std::vector<uint32_t> byZMin;
+  std::vector<double> zMinSorted;
+  std::vector<double> zMax;
+  std::vector<uint32_t> active;
+};
+
+/**
+ Slice meshes at evenly spaced heights in a single upward sweep.
+ 
+ All faces are sorted by their lowest z once. While the plane moves up, a
+ face joins the active list when the plane passes its lowest point, and
+ leaves it when the plane passes its highest point, so every layer only
+ looks at the faces that cross it.
+ */
+class ISSlicer
+{
+public:
+  ISSlicer();
+  void clear();
+  void addMesh(const ISMesh*);
+  void addMesh(const ISHalfEdgeMesh*);
+  void sortFaces(ISSweepMesh &sm, const std::vector<double> &zMin);
+  int sweep(ISMeshSlice &slice, double firstZ, double lastZ, double layerHeight,
+            ISSliceCallback *cb, void *userData=0L);
+  int sliceParallel(double firstZ, double lastZ, double layerHeight,
+                    ISSliceCallback *work, ISSliceCallback *done,
+                    void *userData=0L, int nThreads=0);
+  static int nLayers(double firstZ, double lastZ, double layerHeight);
+  std::vector<ISSweepMesh> pMeshList;
+  double pSliceTime;
 };
 
+/**
+ Time spent in every phase of writing a .3dp file.
+ 
+ Slicing, rasterizing and encoding run on many threads at once, so their
+ times are the sum over all threads. openContours counts the contours that
+ did not close because of a hole in a mesh, and were closed with a straight
+ line.
+ */
+struct ISWriteStats
+{
+  double slice, rasterize, encode, write;
+  size_t bytes;
+  int openContours;
+};
+
+/**
+ Write a .3dp file through a large buffer.
+ 
+ Data is collected in memory and written in big blocks. With a background
+ flush thread, a full buffer is written to disk while the next one is being
+ filled.
+ */
+class IS3dpFile
+{
+public:
+  IS3dpFile();
+  ~IS3dpFile();
+  bool open(const char *filename, bool backgroundFlush=false, size_t bufferSize=1<<20);
+  void writeInt(int32_t x);
+  void writeFixedInt(int32_t x);
+  void write(const void *data, size_t size);
+  int close();
+  size_t pBytes;
+private:
+  IS3dpFile(const IS3dpFile&);
+  IS3dpFile &operator=(const IS3dpFile&);
+  void flush();
+  void flushThread();
+  FILE *pFile;
+  std::vector<unsigned char> pBuffer, pFlushBuffer;
+  size_t pFill;
+  bool pError, pFlushPending, pQuit;
+  std::thread pThread;
+  std::mutex pMutex;
+  std::condition_variable pCond;
+};
+
+extern ISMeshList gMeshList;
+
+void writeInt(std::vector<unsigned char> &buf, int32_t x);
+void transposeBits(const uint32_t *rows, size_t rowStride, int nRows,
+                   uint32_t *cols, size_t colStride, int nCols);
+void transposeBitsScalar(const uint32_t *rows, size_t rowStride, int nRows,
+                         uint32_t *cols, size_t colStride, int nCols);
+void writeLayerSwaths(std::vector<unsigned char> &buf, const ISLayerBitmap &bm, int nDrops, int interleave);
+int write3dp(const char *filename, ISSlicer &slicer,
+             double firstZ, double lastZ, double layerHeight,
+             ISSliceCallback *progress=0L, void *userData=0L,
+             int nThreads=0, ISWriteStats *stats=0L);
+int readStlCoordinates(const char *filename, std::vector<float> &coords);
+void loadStl(const char *filename, double weldEpsilon=gWeldEpsilon);
+double isTime();
+
 
 #endif /* defined(__IotaSlice__IotaSlice__) */
@@ -0,0 +1,633 @@
+//
+//  IotaSliceCLI.cpp
+//  IotaSlice
+//
+//  Copyright (c) 2013 Matthias Melcher. All rights reserved.
+//
+
+/*
+ iotaslice - slice a model into a .3dp file without a user interface.
+
+ usage: iotaslice [options] model.stl output.3dp
+
+ The layer range defaults to the height of the model. Every phase is timed,
+ and the times are printed when the file is written.
+ 
+ "iotaslice -t" checks that a mesh with a hole slices without crashing, and
+ checks the bit transpose kernels against each other and prints how many
+ columns per second they convert.
+ 
+ "iotaslice -b test model.stl" checks and times one part of the slicer on a
+ model, or on a torus of 1M triangles if no model is given:
+   edges    building the edge index of the mesh, and the linear search that
+            it replaced on the first faces of the mesh
+   mesh     memory and slicing speed of ISMesh and ISHalfEdgeMesh
+   threads  writing a .3dp file with 1 thread up to all cores
+ */
+
+#include "IotaSlice.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include <math.h>
+
+
+static void usage()
+{
+    fprintf(stderr,
+            "usage: iotaslice [options] model.stl output.3dp\n"
+            "  -z first,last   layer range in mm, defaults to the model height\n"
+            "  -l height       layer height in mm, default 0.1\n"
+            "  -j threads      number of slicing threads, default all cores\n"
+            "  -e epsilon      merge points closer than this, default %g\n"
+            "  -m mesh         slice through \"ismesh\" (default) or \"halfedge\"\n"
+            "usage: iotaslice -t\n"
+            "  check slicing an open mesh, check and time the bit transpose kernels\n"
+            "usage: iotaslice -b test [-s faces] [model.stl]\n"
+            "  check and time a part of the slicer on a model, or on a torus of\n"
+            "  1M triangles; test is one of\n"
+            "  edges           build the edge index of the mesh, and compare it to\n"
+            "                  a linear search on the first 20000 or -s faces\n"
+            "  mesh            compare ISMesh and ISHalfEdgeMesh\n"
+            "  threads         write the model with more and more threads\n",
+            gWeldEpsilon);
+}
+
+typedef void (ISTransposeFn)(const uint32_t*, size_t, int, uint32_t*, size_t, int);
+
+/**
+ Turn rows into columns one pixel at a time, the way swaths used to be read.
+ */
+static void transposeBitsPixel(const uint32_t *rows, size_t rowStride, int nRows,
+                               uint32_t *cols, size_t colStride, int nCols)
+{
+    int c, j;
+    for (c=0; c<nCols; c++) {
+        uint32_t v = 0;
+        for (j=0; j<nRows; j++) {
+            v |= ((rows[j*rowStride+(c>>5)]>>(c&31))&1)<<j;
+        }
+        cols[c*colStride] = v;
+    }
+}
+
+/**
+ Check that all transpose kernels agree and time them for a few nozzle counts.
+ 
+ \return 0 if all kernels produced the same columns
+ */
+static int testTranspose()
+{
+    static const int nozzleCounts[] = { 12, 16, 32 };
+    static const char *names[] = { "per pixel", "scalar", "simd" };
+    ISTransposeFn *fn[] = { transposeBitsPixel, transposeBitsScalar, transposeBits };
+    const int nCols = 4000, wordsPerRow = (nCols+31)/32;
+    std::vector<uint32_t> rows(32*wordsPerRow), cols[3];
+    int i, k, n, err = 0;
+    srand(1);
+    for (i=0; i<(int)rows.size(); i++) {
+        rows[i] = ((uint32_t)rand()<<16)^(uint32_t)rand();
+    }
+    printf("nozzles  kernel      Mcolumns/s\n");
+    for (n=0; n<3; n++) {
+        int nRows = nozzleCounts[n];
+        for (k=0; k<3; k++) {
+            cols[k].assign(nCols, 0xdeadbeef);
+            fn[k](&rows[0], wordsPerRow, nRows, &cols[k][0], 1, nCols);
+            // also check a width that ends in a partial block
+            fn[k](&rows[0], wordsPerRow, nRows, &cols[k][0], 1, nCols-37);
+            if (cols[k]!=cols[0]) {
+                printf("ERROR: %s kernel differs for %d nozzles\n", names[k], nRows);
+                err = 1;
+            }
+            int reps = 0;
+            double t0 = isTime(), t1;
+            do {
+                fn[k](&rows[0], wordsPerRow, nRows, &cols[k][0], 1, nCols);
+                reps++;
+                t1 = isTime();
+            } while (t1-t0<0.2);
+            printf("%7d  %-10s %11.1f\n", nRows, names[k], (double)reps*nCols/(t1-t0)/1e6);
+        }
+    }
+    return err;
+}
+
+static bool samePoint(const ISVec3 &a, const ISVec3 &b)
+{
+    return a.x()==b.x() && a.y()==b.y() && a.z()==b.z();
+}
+
+/**
+ Check that two slices hold the same lid contours with bit identical points.
+ */
+static bool sameContours(const ISMeshSlice &a, const ISMeshSlice &b)
+{
+    size_t i, n = a.lidEdgeList.size();
+    if (n!=b.lidEdgeList.size())
+        return false;
+    for (i=0; i<n; i++) {
+        ISEdge *ea = a.lidEdgeList[i], *eb = b.lidEdgeList[i];
+        if (ea==0L || eb==0L) {
+            if (ea!=eb)
+                return false;
+        } else if (   !samePoint(ea->pVertex[0]->pPosition, eb->pVertex[0]->pPosition)
+                   || !samePoint(ea->pVertex[1]->pPosition, eb->pVertex[1]->pPosition)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ Slice an octahedron through its upper half, once closed and once with a
+ face missing, as an ISMesh and as an ISHalfEdgeMesh.
+ 
+ \return 0 if both meshes give the same contours and find the hole
+ */
+static int testOpenMesh()
+{
+    static const float point[6][3] = {
+        { 1, 0, 0 }, { 0, 1, 0 }, { -1, 0, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 }
+    };
+    static const int corner[8][3] = {
+        { 0, 1, 4 }, { 1, 2, 4 }, { 2, 3, 4 }, { 3, 0, 4 },
+        { 1, 0, 5 }, { 2, 1, 5 }, { 3, 2, 5 }, { 0, 3, 5 }
+    };
+    int i, j, nHoles, err = 0;
+    for (nHoles=0; nHoles<2; nHoles++) {
+        ISMesh m;
+        ISVertexWelder welder(&m);
+        for (i=0; i<6; i++) {
+            welder.addPoint(point[i][0], point[i][1], point[i][2]);
+        }
+        // leave out the first face for the open mesh
+        for (i=nHoles; i<8; i++) {
+            ISFace *f = new (m.arena) ISFace();
+            for (j=0; j<3; j++) {
+                f->pVertex[j] = m.vertexList[corner[i][j]];
+            }
+            m.addFace(f);
+        }
+        m.buildZIndex();
+        ISHalfEdgeMesh he;
+        he.set(m);
+        he.buildZIndex();
+        ISMeshSlice a, b;
+        a.addZSlice(m, 0.5);
+        b.addZSlice(he, 0.5);
+        if (   !sameContours(a, b) || a.pNOpenContours!=b.pNOpenContours
+            || (a.pNOpenContours>0)!=(nHoles>0)) {
+            printf("ERROR: %s mesh sliced to %d and %d open contours\n",
+                   nHoles ? "open" : "closed", a.pNOpenContours, b.pNOpenContours);
+            err = 1;
+        }
+    }
+    return err;
+}
+
+/**
+ Build the edge index of the first nFaces faces of a mesh the way
+ ISMesh::addFace() does, for at least 0.2 seconds.
+ 
+ \return the time for one build in seconds
+ */
+static double timeEdgeIndex(const ISMesh &m, size_t nFaces, ISEdgeIndex &index, size_t &nEdges)
+{
+    size_t i;
+    int k, reps = 0;
+    double t0 = isTime(), t1;
+    do {
+        index.clear();
+        index.reserve(3*nFaces/2);
+        nEdges = 0;
+        for (i=0; i<nFaces; i++) {
+            ISFace *f = m.faceList[i];
+            for (k=0; k<3; k++) {
+                if (!index.find(f->pVertex[k], f->pVertex[(k+1)%3])) {
+                    index.insert(f->pEdge[k]);
+                    nEdges++;
+                }
+            }
+        }
+        reps++;
+        t1 = isTime();
+    } while (t1-t0<0.2);
+    return (t1-t0)/reps;
+}
+
+/**
+ Find an edge by walking the whole edge list, the way ISMesh::findEdge()
+ did before there was an edge index.
+ */
+static ISEdge *scanEdges(const ISEdgeList &edges, ISVertex *v0, ISVertex *v1)
+{
+    size_t i, n = edges.size();
+    for (i=0; i<n; i++) {
+        ISEdge *e = edges[i];
+        if ((e->pVertex[0]==v0 && e->pVertex[1]==v1) || (e->pVertex[0]==v1 && e->pVertex[1]==v0))
+            return e;
+    }
+    return 0L;
+}
+
+/**
+ Build the edge list of the first nFaces faces with scanEdges(), for at
+ least 0.2 seconds.
+ 
+ \return the time for one build in seconds, or -1 if an edge was found
+         that is not the edge of the face
+ */
+static double timeEdgeScan(const ISMesh &m, size_t nFaces, ISEdgeList &edges)
+{
+    size_t i;
+    int k, reps = 0;
+    double t0 = isTime(), t1;
+    do {
+        edges.clear();
+        for (i=0; i<nFaces; i++) {
+            ISFace *f = m.faceList[i];
+            for (k=0; k<3; k++) {
+                ISEdge *e = scanEdges(edges, f->pVertex[k], f->pVertex[(k+1)%3]);
+                if (!e)
+                    edges.push_back(f->pEdge[k]);
+                else if (e!=f->pEdge[k])
+                    return -1.0;
+            }
+        }
+        reps++;
+        t1 = isTime();
+    } while (t1-t0<0.2);
+    return (t1-t0)/reps;
+}
+
+/**
+ Time building the edge index of a mesh, and compare it to the linear
+ search that it replaced on the first nScan faces.
+ 
+ \return 0 if the index and the search find the same edges that the mesh has
+ */
+static int benchEdges(const ISMesh &m, size_t nScan)
+{
+    size_t i, nFaces = m.faceList.size(), nEdges = 0, nScanEdges = 0;
+    int k, err = 0;
+    ISEdgeIndex index;
+    if (nScan>nFaces) nScan = nFaces;
+    printf("method            faces     edges   build ms  Medges/s\n");
+    if (nScan>0) {
+        ISEdgeList edges;
+        double dt = timeEdgeScan(m, nScan, edges);
+        if (dt<0.0) {
+            printf("ERROR: the linear search found a wrong edge\n");
+            return 1;
+        }
+        printf("linear search %9d %9d %10.2f %9.3f\n", (int)nScan, (int)edges.size(),
+               dt*1000.0, edges.size()/dt/1e6);
+        dt = timeEdgeIndex(m, nScan, index, nScanEdges);
+        printf("edge index    %9d %9d %10.2f %9.3f\n", (int)nScan, (int)nScanEdges,
+               dt*1000.0, nScanEdges/dt/1e6);
+        if (nScanEdges!=edges.size()) {
+            printf("ERROR: %d edges in the index, %d found by the linear search\n",
+                   (int)nScanEdges, (int)edges.size());
+            err = 1;
+        }
+    }
+    double dt = timeEdgeIndex(m, nFaces, index, nEdges);
+    printf("edge index    %9d %9d %10.2f %9.3f\n", (int)nFaces, (int)nEdges,
+           dt*1000.0, nEdges/dt/1e6);
+    if (nEdges!=m.edgeList.size()) {
+        printf("ERROR: %d edges in the index, %d in the mesh\n", (int)nEdges, (int)m.edgeList.size());
+        err = 1;
+    }
+    for (i=0; i<nFaces && !err; i++) {
+        ISFace *f = m.faceList[i];
+        for (k=0; k<3; k++) {
+            if (   index.find(f->pVertex[k], f->pVertex[(k+1)%3])!=f->pEdge[k]
+                || index.find(f->pVertex[(k+1)%3], f->pVertex[k])!=f->pEdge[k]) {
+                printf("ERROR: wrong edge %d of face %d\n", k, (int)i);
+                err = 1;
+                break;
+            }
+        }
+    }
+    return err;
+}
+
+/**
+ Slice a mesh at every 0.1mm for at least 0.2 seconds.
+ 
+ \return the number of layers per second
+ */
+template <class Mesh>
+static double timeSlices(const Mesh &m, double minZ, int nLayers)
+{
+    ISMeshSlice slice;
+    int layer, reps = 0;
+    double t0 = isTime(), t1;
+    do {
+        for (layer=0; layer<nLayers; layer++) {
+            slice.clear();
+            slice.addZSlice(m, minZ + 0.05 + layer*0.1);
+        }
+        reps++;
+        t1 = isTime();
+    } while (t1-t0<0.2);
+    return (double)reps*nLayers/(t1-t0);
+}
+
+/**
+ Compare the size of a mesh and the speed of slicing it to a copy in an
+ ISHalfEdgeMesh.
+ 
+ \return 0 if both meshes give the same contours in every layer
+ */
+static int benchMesh(const ISMesh &m)
+{
+    ISHalfEdgeMesh he;
+    he.set(m);
+    he.buildZIndex();
+    int i, layer, err = 0, n = (int)m.vertexList.size();
+    double minZ = DBL_MAX, maxZ = -DBL_MAX;
+    for (i=0; i<n; i++) {
+        double z = m.vertexList[i]->pPosition.z();
+        if (z<minZ) minZ = z;
+        if (z>maxZ) maxZ = z;
+    }
+    int nLayers = ISSlicer::nLayers(minZ + 0.05, maxZ, 0.1);
+    ISMeshSlice a, b;
+    for (layer=0; layer<nLayers && !err; layer++) {
+        double z = minZ + 0.05 + layer*0.1;
+        a.clear();
+        a.addZSlice(m, z);
+        b.clear();
+        b.addZSlice(he, z);
+        if (!sameContours(a, b)) {
+            err = 1;
+            printf("ERROR: the meshes give different contours at z=%g\n", z);
+        }
+    }
+    double nFaces = (double)m.faceList.size();
+    printf("mesh             bytes/face  layers/s\n");
+    printf("ISMesh           %10.1f %9.1f\n", m.memoryUsage()/nFaces, timeSlices(m, minZ, nLayers));
+    printf("ISHalfEdgeMesh   %10.1f %9.1f\n", he.memoryUsage()/nFaces, timeSlices(he, minZ, nLayers));
+    return err;
+}
+
+/**
+ Add the data of a layer to an FNV-1a hash, in z order.
+ */
+static void hashLayerCB(ISMeshSlice &slice, int layer, double z, void *userData)
+{
+    uint32_t &hash = *(uint32_t*)userData;
+    size_t i, n = slice.layerData.size();
+    for (i=0; i<n; i++) {
+        hash = (hash^slice.layerData[i])*16777619U;
+    }
+}
+
+/**
+ Write a model to /dev/null with 1, 2, 4 and so on threads, up to the
+ number of cores. At least 4 threads are tried, so that the layer order is
+ checked even on a machine with fewer cores.
+ 
+ \return 0 if every thread count wrote the same data
+ */
+static int benchThreads(const ISMesh &m)
+{
+    ISSlicer slicer;
+    slicer.addMesh(&m);
+    int i, n = (int)m.vertexList.size(), err = 0;
+    double minZ = DBL_MAX, maxZ = -DBL_MAX;
+    for (i=0; i<n; i++) {
+        double z = m.vertexList[i]->pPosition.z();
+        if (z<minZ) minZ = z;
+        if (z>maxZ) maxZ = z;
+    }
+    int nMax = (int)std::thread::hardware_concurrency();
+    if (nMax<4) nMax = 4;
+    uint32_t hash1 = 0;
+    double time1 = 0.0;
+    printf("threads  layers/s  speedup\n");
+    for (n=1; ; n*=2) {
+        if (n>nMax) n = nMax;
+        uint32_t hash = 2166136261U;
+        double t0 = isTime();
+        int nLayers = write3dp("/dev/null", slicer, minZ + 0.05, maxZ, 0.1,
+                               hashLayerCB, &hash, n);
+        double dt = isTime()-t0;
+        if (nLayers<0) {
+            return 1;
+        }
+        if (n==1) {
+            hash1 = hash;
+            time1 = dt;
+        } else if (hash!=hash1) {
+            printf("ERROR: %d threads wrote different data than 1 thread\n", n);
+            err = 1;
+        }
+        printf("%7d %9.1f %8.2f\n", n, nLayers/dt, time1/dt);
+        if (n==nMax) break;
+    }
+    return err;
+}
+
+/**
+ Add a closed torus of about nFaces triangles to gMeshList.
+ 
+ The torus has a radius of 40mm around the z axis and a tube radius of
+ 15mm, so 0.1mm layers give 300 layers. Vertices and faces come in the same
+ order as from an STL file with the same triangles.
+ */
+static void makeTorus(int nFaces)
+{
+    const double R = 40.0, r = 15.0;
+    int i, j, u = (int)sqrt(nFaces/2.0), v = nFaces/(2*u);
+    if (v<3) v = 3;
+    ISMesh *isMesh = new ISMesh();
+    gMeshList.push_back(isMesh);
+    ISVertexWelder welder(isMesh, 0.0);
+    welder.reserve(u*v);
+    for (i=0; i<u; i++) {
+        for (j=0; j<v; j++) {
+            double a = 2.0*M_PI*i/u, b = 2.0*M_PI*j/v;
+            welder.addPoint((float)((R+r*cos(b))*cos(a)), (float)((R+r*cos(b))*sin(a)), (float)(r*sin(b)));
+        }
+    }
+    isMesh->faceList.reserve(2*(size_t)u*v);
+    isMesh->edgeList.reserve(3*(size_t)u*v);
+    isMesh->edgeIndex.reserve(3*(size_t)u*v);
+    for (i=0; i<u; i++) {
+        for (j=0; j<v; j++) {
+            // the corners of one quad, split into two triangles
+            ISVertex *p[4] = {
+                isMesh->vertexList[i*v+j],
+                isMesh->vertexList[((i+1)%u)*v+j],
+                isMesh->vertexList[((i+1)%u)*v+(j+1)%v],
+                isMesh->vertexList[i*v+(j+1)%v]
+            };
+            ISFace *f = new (isMesh->arena) ISFace();
+            f->pVertex[0] = p[0]; f->pVertex[1] = p[1]; f->pVertex[2] = p[2];
+            isMesh->addFace(f);
+            f = new (isMesh->arena) ISFace();
+            f->pVertex[0] = p[0]; f->pVertex[1] = p[2]; f->pVertex[2] = p[3];
+            isMesh->addFace(f);
+        }
+    }
+    isMesh->clearNormals();
+    isMesh->calculateNormals();
+    isMesh->buildZIndex();
+}
+
+/**
+ Load a model and run one of the benchmarks on it.
+ 
+ \param modelName an STL file, or NULL for a torus of 1M triangles
+ \return 0 if all checks passed, 1 if one failed or the test is unknown
+ */
+static int bench(const char *test, const char *modelName, int nScan)
+{
+    if (modelName) {
+        loadStl(modelName, gWeldEpsilon);
+    } else {
+        makeTorus(1000000);
+    }
+    if (gMeshList.empty()) {
+        return 1;
+    }
+    const ISMesh &m = *gMeshList[0];
+    if (strcmp(test, "edges")==0) {
+        return benchEdges(m, nScan);
+    }
+    if (strcmp(test, "mesh")==0) {
+        return benchMesh(m);
+    }
+    if (strcmp(test, "threads")==0) {
+        return benchThreads(m);
+    }
+    usage();
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    double firstLayer = 0.0, lastLayer = 0.0, layerHeight = 0.1;
+    double weldEpsilon = gWeldEpsilon;
+    bool hasRange = false, halfEdge = false;
+    int nThreads = 0;
+    const char *modelName = 0L, *outName = 0L;
+
+    int i;
+    if (argc==2 && strcmp(argv[1], "-t")==0) {
+        return testOpenMesh() | testTranspose();
+    }
+    if (argc>=3 && strcmp(argv[1], "-b")==0) {
+        int nScan = 20000;
+        for (i=3; i<argc; i++) {
+            if (strcmp(argv[i], "-s")==0 && i+1<argc) {
+                nScan = atoi(argv[++i]);
+            } else if (argv[i][0]!='-' && !modelName) {
+                modelName = argv[i];
+            } else {
+                usage();
+                return 1;
+            }
+        }
+        return bench(argv[2], modelName, nScan);
+    }
+    for (i=1; i<argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0]=='-' && arg[1] && !arg[2] && i+1<argc) {
+            const char *val = argv[++i];
+            switch (arg[1]) {
+                case 'z':
+                    if (sscanf(val, "%lf,%lf", &firstLayer, &lastLayer)!=2) {
+                        usage();
+                        return 1;
+                    }
+                    hasRange = true;
+                    break;
+                case 'l': layerHeight = atof(val); break;
+                case 'j': nThreads = atoi(val); break;
+                case 'e': weldEpsilon = atof(val); break;
+                case 'm':
+                    if (strcmp(val, "halfedge")==0) {
+                        halfEdge = true;
+                    } else if (strcmp(val, "ismesh")!=0) {
+                        usage();
+                        return 1;
+                    }
+                    break;
+                default: usage(); return 1;
+            }
+        } else if (!modelName) {
+            modelName = arg;
+        } else if (!outName) {
+            outName = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (!modelName || !outName || layerHeight<=0.0) {
+        usage();
+        return 1;
+    }
+
+    double t0 = isTime();
+    loadStl(modelName, weldEpsilon);
+    if (gMeshList.empty()) {
+        return 1;
+    }
+    double t1 = isTime();
+
+    ISSlicer slicer;
+    int n = (int)gMeshList.size();
+    std::vector<ISHalfEdgeMesh> heMeshList(halfEdge ? n : 0);
+    double minZ = DBL_MAX, maxZ = -DBL_MAX;
+    for (i=0; i<n; i++) {
+        ISMesh *isMesh = gMeshList[i];
+        if (halfEdge) {
+            heMeshList[i].set(*isMesh);
+            heMeshList[i].buildZIndex();
+            slicer.addMesh(&heMeshList[i]);
+        } else {
+            slicer.addMesh(isMesh);
+        }
+        int j, nv = (int)isMesh->vertexList.size();
+        for (j=0; j<nv; j++) {
+            double z = isMesh->vertexList[j]->pPosition.z();
+            if (z<minZ) minZ = z;
+            if (z>maxZ) maxZ = z;
+        }
+    }
+    if (!hasRange) {
+        // slice through the middle of every layer
+        firstLayer = minZ + layerHeight/2.0;
+        lastLayer = maxZ;
+    }
+    double t2 = isTime();
+
+    ISWriteStats stats;
+    int nLayers = write3dp(outName, slicer, firstLayer, lastLayer, layerHeight,
+                           0L, 0L, nThreads, &stats);
+    if (nLayers<0) {
+        return 1;
+    }
+    double t3 = isTime();
+    if (stats.openContours) {
+        printf("WARNING: %d contours did not close because of holes in the mesh\n", stats.openContours);
+    }
+
+    printf("%d layers from %g to %g mm, %.1f MB\n",
+           nLayers, firstLayer, lastLayer, stats.bytes/1048576.0);
+    printf("  load       %8.3fs\n", t1-t0);
+    printf("  prepare    %8.3fs\n", t2-t1);
+    printf("  slice      %8.3fs  (all threads)\n", stats.slice);
+    printf("  rasterize  %8.3fs  (all threads)\n", stats.rasterize);
+    printf("  encode     %8.3fs  (all threads)\n", stats.encode);
+    printf("  write      %8.3fs\n", stats.write);
+    printf("  total      %8.3fs  (%.1f layers/s)\n", t3-t0, nLayers/(t3-t2));
+    return 0;
+}
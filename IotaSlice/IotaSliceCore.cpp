@@ -0,0 +1,2701 @@
+//
+//  IotaSliceCore.cpp
+//  IotaSlice
+//
+//  Copyright (c) 2013 Matthias Melcher. All rights reserved.
+//
+
+/*
+ Everything that is needed to turn a model into printer commands, without
+ any user interface. This file is shared by the IotaSlice application and
+ the iotaslice command line tool.
+ */
+
+#include "IotaSlice.h"
+
+#ifdef __APPLE__
+#include <OpenGL/glu.h>
+#else
+#include <GL/glu.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <new>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+
+ISMeshList gMeshList;
+
+/**
+ Return a time stamp in seconds for measuring how long things take.
+ */
+double isTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// -----------------------------------------------------------------------------
+
+/**
+ Encode a number in the variable length format of .3dp files.
+ 
+ Seven bits go into every byte, most significant first, and all bytes but
+ the last have bit 7 set.
+ 
+ \param dst at least five bytes of space
+ \return the byte after the encoded number
+ */
+static inline unsigned char *encodeInt(unsigned char *dst, int32_t x)
+{
+    // bits 34..28
+    if (x&(0xffffffff<<28)) *dst++ = ((x>>28) & 0x7f) | 0x80;
+    // bits 27..21
+    if (x&(0xffffffff<<21)) *dst++ = ((x>>21) & 0x7f) | 0x80;
+    // bits 20..14
+    if (x&(0xffffffff<<14)) *dst++ = ((x>>14) & 0x7f) | 0x80;
+    // bits 13..7
+    if (x&(0xffffffff<<7)) *dst++ = ((x>>7) & 0x7f) | 0x80;
+    // bits 6..0
+    *dst++ = x & 0x7f;
+    return dst;
+}
+
+/**
+ Append a number in the same variable length format to a buffer.
+ */
+void writeInt(std::vector<unsigned char> &buf, int32_t x)
+{
+    size_t n = buf.size();
+    buf.resize(n+5);
+    buf.resize(encodeInt(&buf[n], x)-&buf[0]);
+}
+
+/**
+ Encode a layer bitmap as print head commands.
+ 
+ The bitmap is printed in swaths of 12 rows, one row per nozzle. Every
+ swath moves the head to the first column that has any pixel set, and
+ then fires one 12 bit pattern per column. Runs of empty columns are
+ skipped, and runs of the same pattern are fired with a single command.
+ 
+ \param buf commands are appended here
+ \param nDrops number of drops per pattern
+ \param interleave number of passes per 12 rows
+ */
+void writeLayerSwaths(std::vector<unsigned char> &buf, const ISLayerBitmap &bm, int nDrops, int interleave)
+{
+    int nNozzles = gIotaNozzles;
+    int incr = nNozzles/interleave;
+    int x, i, n = (bm.pHeight-nNozzles+1)/incr, ww = bm.pWidth;
+    for (i=0; i<n; i++) {
+        int y = i*incr, nLeft = 0, nFill = 0, nRight = 0;
+        // find the first pixel
+        for (x=0; x<ww; x++) {
+            if (bm.nozzles(x, y, nNozzles)) break;
+        }
+        if (x<ww) {
+            nLeft = x;
+            for (x=ww-1; x>nLeft; x--) {
+                if (bm.nozzles(x, y, nNozzles)) break;
+            }
+            nRight = ww-x;
+            nFill = ww-nLeft-nRight;
+            // make room for the longest possible swath and encode it in one go
+            size_t start = buf.size();
+            buf.resize(start+4*5+nFill*3*5);
+            unsigned char *dst = &buf[start];
+            // yGoto
+            dst = encodeInt(dst, 147);
+            dst = encodeInt(dst, 22000+425*i*incr/12); // swash height (428)
+            // xGoto
+            dst = encodeInt(dst, 144);
+            dst = encodeInt(dst, 100+36*nLeft); // first pixel
+            for (x=nLeft; x<nLeft+nFill; ) {
+                uint32_t pattern = bm.nozzles(x, y, nNozzles);
+                int run = 1;
+                while (x+run<nLeft+nFill && bm.nozzles(x+run, y, nNozzles)==pattern)
+                    run++;
+                if (pattern==0) {
+                    // skip empty columns
+                    dst = encodeInt(dst, 4);
+                    dst = encodeInt(dst, run);
+                } else if (run>1) {
+                    // fire pattern times n, repeat in the next columns
+                    dst = encodeInt(dst, 3);
+                    dst = encodeInt(dst, pattern);
+                    dst = encodeInt(dst, nDrops);
+                    dst = encodeInt(dst, run);
+                } else {
+                    // fire pattern times n
+                    dst = encodeInt(dst, 2);
+                    dst = encodeInt(dst, pattern);
+                    dst = encodeInt(dst, nDrops);
+                }
+                x += run;
+            }
+            buf.resize(dst-&buf[0]);
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+ISArena::ISArena(size_t blockSize)
+:   pBlockSize(blockSize),
+    pBlock(-1),
+    pNext(0L),
+    pEnd(0L)
+{
+}
+
+ISArena::~ISArena()
+{
+    clear();
+}
+
+/**
+ Return a block of memory that stays valid until the arena is cleared.
+ 
+ Throws std::bad_alloc if there is no memory left, just like new.
+ */
+void *ISArena::allocate(size_t size)
+{
+    size = (size+15) & ~(size_t)15;
+    while (pNext+size>pEnd) {
+        if (pBlock+1==(int)pBlockList.size()) {
+            size_t n = (size>pBlockSize) ? size : pBlockSize;
+            char *block = (char*)malloc(n);
+            if (!block)
+                throw std::bad_alloc();
+            pBlockList.push_back(block);
+            pBlockSizeList.push_back(n);
+        }
+        pBlock++;
+        // blocks that were kept by reset() may be too small for this request
+        pNext = pBlockList[pBlock];
+        pEnd = pNext + pBlockSizeList[pBlock];
+    }
+    void *ret = pNext;
+    pNext += size;
+    return ret;
+}
+
+/**
+ Forget all allocations, but keep the memory blocks for reuse.
+ */
+void ISArena::reset()
+{
+    pBlock = -1;
+    pNext = 0L;
+    pEnd = 0L;
+}
+
+/**
+ Release all memory at once.
+ */
+void ISArena::clear()
+{
+    int i, n = (int)pBlockList.size();
+    for (i=0; i<n; i++) {
+        free(pBlockList[i]);
+    }
+    pBlockList.clear();
+    pBlockSizeList.clear();
+    reset();
+}
+
+// -----------------------------------------------------------------------------
+
+ISVec3::ISVec3()
+{
+    pV[0] = 0.0;
+    pV[1] = 0.0;
+    pV[2] = 0.0;
+}
+
+ISVec3::ISVec3(const ISVec3 &v)
+{
+    pV[0] = v.pV[0];
+    pV[1] = v.pV[1];
+    pV[2] = v.pV[2];
+}
+
+ISVec3::ISVec3(double *v)
+{
+    pV[0] = v[0];
+    pV[1] = v[1];
+    pV[2] = v[2];
+}
+
+ISVec3::ISVec3(float x, float y, float z)
+{
+    pV[0] = x;
+    pV[1] = y;
+    pV[2] = z;
+}
+
+void ISVec3::set(float x, float y, float z)
+{
+    pV[0] = x;
+    pV[1] = y;
+    pV[2] = z;
+}
+
+void ISVec3::read(float *v)
+{
+    pV[0] = v[0];
+    pV[1] = v[1];
+    pV[2] = v[2];
+}
+
+void ISVec3::read(double *v)
+{
+    pV[0] = v[0];
+    pV[1] = v[1];
+    pV[2] = v[2];
+}
+
+void ISVec3::write(double *v)
+{
+    v[0] = pV[0];
+    v[1] = pV[1];
+    v[2] = pV[2];
+}
+
+double ISVec3::normalize()
+{
+    double len = sqrt(pV[0]*pV[0]+pV[1]*pV[1]+pV[2]*pV[2]);
+    if (len==0.0) {
+        len = 1.0;
+    } else {
+        len = 1.0/len;
+    }
+    pV[0] *= len;
+    pV[1] *= len;
+    pV[2] *= len;
+    return len;
+}
+
+ISVec3& ISVec3::operator-=(const ISVec3 &v)
+{
+    pV[0] -= v.pV[0];
+    pV[1] -= v.pV[1];
+    pV[2] -= v.pV[2];
+    return *this;
+}
+
+ISVec3& ISVec3::operator+=(const ISVec3 &v)
+{
+    pV[0] += v.pV[0];
+    pV[1] += v.pV[1];
+    pV[2] += v.pV[2];
+    return *this;
+}
+
+ISVec3& ISVec3::operator*=(double n)
+{
+    pV[0] *= n;
+    pV[1] *= n;
+    pV[2] *= n;
+    return *this;
+}
+
+ISVec3& ISVec3::cross(const ISVec3 &b)
+{
+    ISVec3 a(*this);
+    pV[0] = a.pV[1]*b.pV[2] - a.pV[2]*b.pV[1];
+    pV[1] = a.pV[2]*b.pV[0] - a.pV[0]*b.pV[2];
+    pV[2] = a.pV[0]*b.pV[1] - a.pV[1]*b.pV[0];
+    return *this;
+}
+
+void ISVec3::zero()
+{
+    pV[0] = 0.0;
+    pV[1] = 0.0;
+    pV[2] = 0.0;
+}
+
+// -----------------------------------------------------------------------------
+
+ISVertex::ISVertex()
+{
+    pPosition.zero();
+    pNormal.zero();
+    pNNormal = 0;
+}
+
+ISVertex::ISVertex(const ISVertex *v)
+{
+    pPosition = v->pPosition;
+    pNormal = v->pNormal;
+    pNNormal = v->pNNormal;
+}
+
+void ISVertex::addNormal(const ISVec3 &v)
+{
+    ISVec3 vn(v);
+    vn.normalize();
+    pNormal += vn;
+    pNNormal++;
+}
+
+void ISVertex::averageNormal()
+{
+    if (pNNormal>0) {
+        double len = 1.0/pNNormal;
+        pNormal *= len;
+    }
+}
+
+void ISVertex::print()
+{
+    printf("v=[%g, %g, %g]\n", pPosition.x(), pPosition.y(), pPosition.z());
+}
+
+// -----------------------------------------------------------------------------
+
+ISEdge::ISEdge()
+{
+    pVertex[0] = 0L;
+    pVertex[1] = 0L;
+    pFace[0] = 0L;
+    pFace[1] = 0L;
+}
+
+ISVertex *ISEdge::vertex(int i, ISFace *f)
+{
+    if (pFace[0]==f) {
+        return pVertex[i];
+    } else if (pFace[1]==f) {
+        return pVertex[1-i];
+    } else {
+        puts("ERROR: vertex() - this edge is not associated with this face!");
+        return 0L;
+    }
+}
+
+ISVertex *ISEdge::findZ(double zMin, ISArena &arena)
+{
+    ISVertex *v0 = pVertex[0], *v1 = pVertex[1];
+    ISVec3 vd0(v0->pPosition);
+    bool retVec = false;
+    vd0 -= v1->pPosition;
+    double dzo = vd0.z(), dzn = zMin-v1->pPosition.z();
+    double m = dzn/dzo;  // TODO: division by zero should not be possible...
+    if (m>=0.0 && m<=1) retVec = true;
+    if (retVec) {
+        ISVertex *v2 = new (arena) ISVertex();
+        vd0 *= m;
+        vd0 += v1->pPosition;
+        v2->pPosition = vd0;
+        return v2;
+    } else {
+        return 0L;
+    }
+}
+
+ISFace *ISEdge::otherFace(ISFace *f)
+{
+    if (pFace[0]==f) {
+        return pFace[1];
+    } else if (pFace[1]==f) {
+        return pFace[0];
+    } else {
+        puts("ERROR: otherFace() - this edge is not associated with this face!");
+        return 0L;
+    }
+}
+
+int ISEdge::indexIn(ISFace *f)
+{
+    if (f->pEdge[0]==this) return 0;
+    if (f->pEdge[1]==this) return 1;
+    if (f->pEdge[2]==this) return 2;
+    puts("ERROR: indexIn() - this edge was not found with this face!");
+    return -1;
+}
+
+int ISEdge::nFaces()
+{
+    int n = 0;
+    if (pFace[0]) n++;
+    if (pFace[1]) n++;
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+
+ISEdgeIndex::ISEdgeIndex()
+:   pSize(0)
+{
+}
+
+void ISEdgeIndex::clear()
+{
+    std::vector<ISEdge*>().swap(pSlot);
+    pSize = 0;
+}
+
+/**
+ Remove all edges, but keep the table at its current size.
+ */
+void ISEdgeIndex::reset()
+{
+    if (pSize)
+        std::fill(pSlot.begin(), pSlot.end(), (ISEdge*)0L);
+    pSize = 0;
+}
+
+/**
+ Make room for n edges.
+ 
+ The table is kept at most half full, and its size is always a power of
+ two, so a bit mask can replace the modulo.
+ */
+void ISEdgeIndex::reserve(size_t n)
+{
+    size_t size = 16;
+    while (size<2*n) size *= 2;
+    if (size<=pSlot.size())
+        return;
+    std::vector<ISEdge*> old(size, (ISEdge*)0L);
+    old.swap(pSlot);
+    size_t i;
+    pSize = 0;
+    for (i=0; i<old.size(); i++) {
+        if (old[i]) insert(old[i]);
+    }
+}
+
+size_t ISEdgeIndex::hash(ISVertex *v0, ISVertex *v1)
+{
+    size_t a = (size_t)v0, b = (size_t)v1;
+    if (a>b) { size_t t = a; a = b; b = t; }
+    a ^= b + 0x9e3779b9 + (a<<6) + (a>>2);
+    return a ^ (a>>17);
+}
+
+ISEdge *ISEdgeIndex::find(ISVertex *v0, ISVertex *v1) const
+{
+    if (pSize==0)
+        return 0L;
+    size_t mask = pSlot.size()-1, i = hash(v0, v1) & mask;
+    for (;;) {
+        ISEdge *e = pSlot[i];
+        if (!e)
+            return 0L;
+        if (   (e->pVertex[0]==v0 && e->pVertex[1]==v1)
+            || (e->pVertex[0]==v1 && e->pVertex[1]==v0))
+            return e;
+        i = (i+1) & mask;
+    }
+}
+
+void ISEdgeIndex::insert(ISEdge *e)
+{
+    if (2*(pSize+1)>pSlot.size())
+        reserve(2*pSize+2);
+    size_t mask = pSlot.size()-1, i = hash(e->pVertex[0], e->pVertex[1]) & mask;
+    while (pSlot[i])
+        i = (i+1) & mask;
+    pSlot[i] = e;
+    pSize++;
+}
+
+// -----------------------------------------------------------------------------
+
+ISFace::ISFace()
+{
+    pVertex[0] = 0L;
+    pVertex[1] = 0L;
+    pVertex[2] = 0L;
+    pEdge[0] = 0L;
+    pEdge[1] = 0L;
+    pEdge[2] = 0L;
+    pNormal.zero();
+    pNNormal = 0;
+    pIndex = 0;
+}
+
+void ISFace::rotateVertices()
+{
+    ISVertex *v = pVertex[0];
+    pVertex[0] = pVertex[1];
+    pVertex[1] = pVertex[2];
+    pVertex[2] = v;
+    ISEdge *e = pEdge[0];
+    pEdge[0] = pEdge[1];
+    pEdge[1] = pEdge[2];
+    pEdge[2] = e;
+}
+
+void ISFace::print()
+{
+    printf("Face: \n");
+    pVertex[0]->print();
+    pVertex[1]->print();
+    pVertex[2]->print();
+}
+
+int ISFace::pointsBelowZ(double zMin)
+{
+    double z0 = pVertex[0]->pPosition.z();
+    double z1 = pVertex[1]->pPosition.z();
+    double z2 = pVertex[2]->pPosition.z();
+    int n = (z0<zMin) + (z1<zMin) + (z2<zMin);
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+
+ISFaceZIndex::ISFaceZIndex()
+:   pNFaces(0)
+{
+}
+
+void ISFaceZIndex::clear()
+{
+    pNodeList.clear();
+    pByZMin.clear();
+    pByZMax.clear();
+    pZMin.clear();
+    pZMax.clear();
+    pNFaces = 0;
+}
+
+/**
+ Build the index for all faces of a mesh.
+ 
+ The index must be built again whenever faces are added to the mesh.
+ */
+void ISFaceZIndex::build(const ISMesh &m)
+{
+    uint32_t i, n = (uint32_t)m.faceList.size();
+    std::vector<double> zMin(n), zMax(n);
+    for (i=0; i<n; i++) {
+        ISFace *f = m.faceList[i];
+        double z0 = f->pVertex[0]->pPosition.z();
+        double z1 = f->pVertex[1]->pPosition.z();
+        double z2 = f->pVertex[2]->pPosition.z();
+        zMin[i] = std::min(z0, std::min(z1, z2));
+        zMax[i] = std::max(z0, std::max(z1, z2));
+    }
+    build(zMin, zMax);
+}
+
+void ISFaceZIndex::build(const ISHalfEdgeMesh &m)
+{
+    uint32_t i, n = m.nFaces();
+    std::vector<double> zMin(n), zMax(n);
+    for (i=0; i<n; i++) {
+        double z0 = m.pZ[m.pHEVertex[3*i]];
+        double z1 = m.pZ[m.pHEVertex[3*i+1]];
+        double z2 = m.pZ[m.pHEVertex[3*i+2]];
+        zMin[i] = std::min(z0, std::min(z1, z2));
+        zMax[i] = std::max(z0, std::max(z1, z2));
+    }
+    build(zMin, zMax);
+}
+
+/**
+ Build the tree from the z range of every face.
+ */
+void ISFaceZIndex::build(const std::vector<double> &zMin, const std::vector<double> &zMax)
+{
+    clear();
+    uint32_t i, n = (uint32_t)zMin.size();
+    std::vector<uint32_t> faces(n);
+    for (i=0; i<n; i++) {
+        faces[i] = i;
+    }
+    pByZMin.reserve(n); pByZMax.reserve(n);
+    pZMin.reserve(n); pZMax.reserve(n);
+    buildNode(faces, zMin, zMax);
+    pNFaces = n;
+}
+
+struct ISZLess {
+    const std::vector<double> &z;
+    ISZLess(const std::vector<double> &v) : z(v) { }
+    bool operator()(uint32_t a, uint32_t b) const { return z[a]<z[b]; }
+};
+
+struct ISZGreater {
+    const std::vector<double> &z;
+    ISZGreater(const std::vector<double> &v) : z(v) { }
+    bool operator()(uint32_t a, uint32_t b) const { return z[a]>z[b]; }
+};
+
+/**
+ Create a node for a list of faces and recursively create its children.
+ 
+ The center is the median of the face centers, so that at most half of the
+ faces end up in either subtree.
+ 
+ \return the index of the new node, or -1 if there are no faces
+ */
+int ISFaceZIndex::buildNode(std::vector<uint32_t> &faces, const std::vector<double> &zMin, const std::vector<double> &zMax)
+{
+    if (faces.empty())
+        return -1;
+    size_t i, n = faces.size();
+    std::vector<double> mid(n);
+    for (i=0; i<n; i++) {
+        mid[i] = 0.5*(zMin[faces[i]]+zMax[faces[i]]);
+    }
+    std::nth_element(mid.begin(), mid.begin()+n/2, mid.end());
+    double center = mid[n/2];
+    
+    std::vector<uint32_t> left, right, here;
+    for (i=0; i<n; i++) {
+        uint32_t f = faces[i];
+        if (zMax[f]<center)
+            left.push_back(f);
+        else if (zMin[f]>center)
+            right.push_back(f);
+        else
+            here.push_back(f);
+    }
+    faces.clear();
+    
+    int ix = (int)pNodeList.size();
+    pNodeList.push_back(ISFaceZNode());
+    pNodeList[ix].center = center;
+    pNodeList[ix].first = (uint32_t)pByZMin.size();
+    pNodeList[ix].n = (uint32_t)here.size();
+    std::sort(here.begin(), here.end(), ISZLess(zMin));
+    for (i=0; i<here.size(); i++) {
+        pByZMin.push_back(here[i]);
+        pZMin.push_back(zMin[here[i]]);
+    }
+    std::sort(here.begin(), here.end(), ISZGreater(zMax));
+    for (i=0; i<here.size(); i++) {
+        pByZMax.push_back(here[i]);
+        pZMax.push_back(zMax[here[i]]);
+    }
+    int l = buildNode(left, zMin, zMax);
+    int r = buildNode(right, zMin, zMax);
+    pNodeList[ix].left = l;
+    pNodeList[ix].right = r;
+    return ix;
+}
+
+/**
+ Append the index of every face with zMin < z <= zMax.
+ 
+ Faces with zMin == z are returned only when z is at or above the center of
+ the node that holds them, so callers must not rely on getting them. The
+ caller still needs to check which vertices are below z.
+ */
+void ISFaceZIndex::findFaces(double z, std::vector<uint32_t> &faces) const
+{
+    int ix = pNodeList.empty() ? -1 : 0;
+    while (ix!=-1) {
+        const ISFaceZNode &node = pNodeList[ix];
+        uint32_t i, end = node.first+node.n;
+        if (z<node.center) {
+            for (i=node.first; i<end && pZMin[i]<z; i++)
+                faces.push_back(pByZMin[i]);
+            ix = node.left;
+        } else {
+            for (i=node.first; i<end && pZMax[i]>=z; i++)
+                faces.push_back(pByZMax[i]);
+            ix = node.right;
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+ISMesh::ISMesh()
+{
+}
+
+/**
+ Remove all vertices, edges and faces.
+ 
+ All topology is allocated in the mesh arena, so there is no need to
+ delete every element on its own.
+ */
+void ISMesh::clear()
+{
+    zIndex.clear();
+    edgeList.clear();
+    edgeIndex.clear();
+    faceList.clear();
+    vertexList.clear();
+    arena.clear();
+}
+
+/**
+ Return the number of bytes used by the mesh data.
+ 
+ This counts the lists, the edge index and every arena block, so it can be
+ compared to ISHalfEdgeMesh::memoryUsage(). The z index is not included.
+ */
+size_t ISMesh::memoryUsage() const
+{
+    size_t i, n = (vertexList.capacity() + edgeList.capacity() + faceList.capacity()
+                   + edgeIndex.pSlot.capacity()) * sizeof(void*);
+    for (i=0; i<arena.pBlockSizeList.size(); i++) {
+        n += arena.pBlockSizeList[i];
+    }
+    return n;
+}
+
+bool ISMesh::validate()
+{
+    if (faceList.size()>0 && edgeList.size()==0) {
+        puts("ERROR: empty edge list!");
+    }
+    int i, n = (int)edgeList.size();
+    for (i=0; i<n; i++) {
+        ISEdge *e = edgeList[i];
+        if (e) {
+            if (e->pFace[0]==0L) {
+                printf("ERROR: edge %d [%p] without face found!\n", i, e);
+            } else if (e->pFace[1]==0L) {
+                printf("ERROR: edge %d [%p] with single face found (hole in mesh)!\n", i, e);
+            }
+            if (e->pFace[0]) {
+                if (e->pFace[0]->pEdge[0]!=e && e->pFace[0]->pEdge[1]!=e && e->pFace[0]->pEdge[2]!=e) {
+                    printf("ERROR: face [%p] is not pointing back at edge %d [%p]!\n", e->pFace[0], i, e);
+                }
+            }
+            if (e->pFace[1]) {
+                if (e->pFace[1]->pEdge[0]!=e && e->pFace[1]->pEdge[1]!=e && e->pFace[1]->pEdge[2]!=e) {
+                    printf("ERROR: face [%p] is not pointing back at edge %d [%p]!\n", e->pFace[1], i, e);
+                }
+            }
+            if (e->pVertex[0]==0L || e->pVertex[1]==0L) {
+                printf("ERROR: edge %d [%p] missing a vertex reference!\n", i, e);
+            }
+        } else {
+            puts("ERROR: zero edge found!");
+        }
+    }
+    n = (int)faceList.size();
+    for (i=0; i<n; i++) {
+        ISFace *f = faceList[i];
+        if (f) {
+            if (f->pVertex[0]==0L || f->pVertex[1]==0L || f->pVertex[1]==0L) {
+                printf("ERROR: face %d has an empty vertex field.\n", i);
+            }
+            if (f->pEdge[0]==0L || f->pEdge[1]==0L || f->pEdge[1]==0L) {
+                printf("ERROR: face %d has an empty edge field.\n", i);
+            } else {
+                if (f->pEdge[0]->vertex(0, f)!=f->pVertex[0])
+                    printf("ERROR: face %d has an edge0/vertex0 missmatch.\n", i);
+                if (f->pEdge[0]->vertex(1, f)!=f->pVertex[1])
+                    printf("ERROR: face %d has an edge0/vertex1 missmatch.\n", i);
+                if (f->pEdge[1]->vertex(0, f)!=f->pVertex[1])
+                    printf("ERROR: face %d has an edge1/vertex1 missmatch.\n", i);
+                if (f->pEdge[1]->vertex(1, f)!=f->pVertex[2])
+                    printf("ERROR: face %d has an edge1/vertex2 missmatch.\n", i);
+                if (f->pEdge[2]->vertex(0, f)!=f->pVertex[2])
+                    printf("ERROR: face %d has an edge2/vertex2 missmatch.\n", i);
+                if (f->pEdge[2]->vertex(1, f)!=f->pVertex[0])
+                    printf("ERROR: face %d has an edge2/vertex0 missmatch.\n", i);
+                if (f->pEdge[0]->pFace[0]!=f && f->pEdge[0]->pFace[1]!=f)
+                    printf("ERROR: face %d edge0 does not point back at face.\n", i);
+                if (f->pEdge[1]->pFace[0]!=f && f->pEdge[1]->pFace[1]!=f)
+                    printf("ERROR: face %d edge1 does not point back at face.\n", i);
+                if (f->pEdge[2]->pFace[0]!=f && f->pEdge[2]->pFace[1]!=f)
+                    printf("ERROR: face %d edge2 does not point back at face.\n", i);
+            }
+        } else {
+            puts("ERROR: zero face found!");
+        }
+    }
+    return true;
+}
+
+/**
+ This function finds edges that have only a single face associated.
+ It then adds a face to this edge and the next edge without a second face.
+ If three edges are connected and none has a second face, a new triangle
+ will fill the hole.
+ */
+void ISMesh::fixHoles()
+{
+    printf("Fixing holes...\n");
+    int i;
+    for (i=0; i<(int)edgeList.size(); i++) {
+        ISEdge *e = edgeList[i];
+        while ( e->nFaces()==1 ) // FIXME: make sure that this is not endless
+            fixHole(e);
+    }
+}
+
+void ISMesh::fixHole(ISEdge *e)
+{
+    printf("Fixing a hole...\n");
+    ISFace *fFix;
+    if (e->pFace[0])
+        fFix = e->pFace[0];
+    else
+        fFix = e->pFace[1];
+    // walk the fan to the left and find the next edge
+    ISFace *fLeft = fFix;
+    ISEdge *eLeft = e;
+    for (;;) {
+        int ix = eLeft->indexIn(fLeft);
+        eLeft = fLeft->pEdge[(ix+2)%3];
+        if (eLeft->nFaces()==1)
+            break;
+        fLeft = eLeft->otherFace(fLeft);
+    }
+    // walk the fan to the right and find the next edge
+    ISFace *fRight = fFix;
+    ISEdge *eRight = e;
+    for (;;) {
+        int ix = eRight->indexIn(fRight);
+        eRight = fRight->pEdge[(ix+1)%3];
+        if (eRight->nFaces()==1)
+            break;
+        fRight = eRight->otherFace(fRight);
+    }
+    // eLeft and eRight are the next connecting edges
+    // fLeft and fRight are the only connected faces
+    // fLeft and fRight can well be fFix
+    ISVertex *vLeft = eLeft->vertex(0, fLeft);
+    ISVertex *vRight = eRight->vertex(1, fRight);
+    if (eLeft==eRight) {
+        // this is a zero size hole: merge the edges
+        puts("ERROR: zero size hole!");
+    } else if ( vLeft==vRight ) {
+        // this triangle fill conpletely fill the hole
+        ISFace *fNew = new (arena) ISFace();
+        fNew->pVertex[0] = e->vertex(1, fFix);
+        fNew->pVertex[1] = e->vertex(0, fFix);
+        fNew->pVertex[2] = vLeft;
+        addFace(fNew);
+    } else if (fFix==fRight) {
+        if (fLeft==fRight) {
+            // we have a single triangle without any connections, delete?
+            ISFace *fNew = new (arena) ISFace();
+            fNew->pVertex[0] = fFix->pVertex[2];
+            fNew->pVertex[1] = fFix->pVertex[1];
+            fNew->pVertex[2] = fFix->pVertex[0];
+            addFace(fNew);
+        } else {
+            fixHole(eRight);
+        }
+    } else {
+        // add one more triangle to get closer to filling the hole
+        ISFace *fNew = new (arena) ISFace();
+        fNew->pVertex[0] = e->vertex(1, fFix);
+        fNew->pVertex[1] = e->vertex(0, fFix);
+        fNew->pVertex[2] = eRight->vertex(1, fRight);
+        addFace(fNew);
+    }
+}
+
+/**
+ Add a face and link it to its edges.
+ 
+ \param newFace a face allocated in the arena of this mesh
+ */
+void ISMesh::addFace(ISFace *newFace)
+{
+    newFace->pEdge[0] = addEdge(newFace->pVertex[0], newFace->pVertex[1], newFace);
+    newFace->pEdge[1] = addEdge(newFace->pVertex[1], newFace->pVertex[2], newFace);
+    newFace->pEdge[2] = addEdge(newFace->pVertex[2], newFace->pVertex[0], newFace);
+    newFace->pIndex = (uint32_t)faceList.size();
+    faceList.push_back(newFace);
+}
+
+/**
+ Find or create the edge between two vertices.
+ 
+ New edges are added to the edge list and to the edge index, so that any
+ later face sharing the same two vertices finds the edge in constant time.
+ */
+ISEdge *ISMesh::addEdge(ISVertex *v0, ISVertex *v1, ISFace *face)
+{
+    ISEdge *isEdge = findEdge(v0, v1);
+    if (isEdge) {
+        isEdge->pFace[1] = face;
+    } else {
+        isEdge = new (arena) ISEdge();
+        isEdge->pVertex[0] = v0;
+        isEdge->pVertex[1] = v1;
+        isEdge->pFace[0] = face;
+        edgeList.push_back(isEdge);
+        edgeIndex.insert(isEdge);
+    }
+    return isEdge;
+}
+
+/**
+ Find the edge that connects two vertices in any direction.
+ 
+ \return the edge, or NULL if the vertices are not connected yet
+ */
+ISEdge *ISMesh::findEdge(ISVertex *v0, ISVertex *v1)
+{
+    return edgeIndex.find(v0, v1);
+}
+
+void ISMesh::clearFaceNormals()
+{
+    int i, n = (int)faceList.size();
+    for (i=0; i<n; i++) {
+        ISFace *isFace = faceList.at(i);
+        isFace->pNNormal = 0;
+    }
+}
+
+void ISMesh::clearVertexNormals()
+{
+    int i, n = (int)vertexList.size();
+    for (i=0; i<n; i++) {
+        ISVertex *isVertex = vertexList.at(i);
+        isVertex->pNNormal = 0;
+    }
+}
+
+void ISMesh::calculateFaceNormals()
+{
+    int i, n = (int)faceList.size();
+    for (i=0; i<n; i++) {
+        ISFace *isFace = faceList.at(i);
+        ISVec3 p0(isFace->pVertex[0]->pPosition);
+        ISVec3 p1(isFace->pVertex[1]->pPosition);
+        ISVec3 p2(isFace->pVertex[2]->pPosition);
+        p1 -= p0;
+        p2 -= p0;
+        ISVec3 n = p1.cross(p2);
+        n.normalize();
+        isFace->pNormal = n;
+        isFace->pNNormal = 1;
+    }
+}
+
+void ISMesh::calculateVertexNormals()
+{
+    int i, n = (int)faceList.size();
+    for (i=0; i<n; i++) {
+        ISFace *isFace = faceList.at(i);
+        ISVec3 n(isFace->pNormal);
+        isFace->pVertex[0]->addNormal(n);
+        isFace->pVertex[1]->addNormal(n);
+        isFace->pVertex[2]->addNormal(n);
+    }
+    n = (int)vertexList.size();
+    for (i=0; i<n; i++) {
+        ISVertex *isVertex = vertexList.at(i);
+        isVertex->averageNormal();
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+ISVertexWelder::ISVertexWelder(ISMesh *mesh, double epsilon)
+:   pMesh(mesh),
+    pEpsilon(epsilon)
+{
+    // add all vertices that are already in the mesh
+    int i, n = (int)pMesh->vertexList.size();
+    for (i=0; i<n; i++) {
+        ISVec3 &p = pMesh->vertexList[i]->pPosition;
+        link(cell(p.x(), p.y(), p.z()), i);
+    }
+}
+
+void ISVertexWelder::reserve(int n)
+{
+    pMesh->vertexList.reserve(n);
+    pNext.reserve(n);
+    pCellHead.reserve(n);
+}
+
+/**
+ Find the grid cell for a point.
+ 
+ If we weld exact duplicates only, the bit pattern of the coordinates is
+ used as the cell index.
+ */
+ISWeldCell ISVertexWelder::cell(float x, float y, float z)
+{
+    ISWeldCell c;
+    if (pEpsilon>0.0) {
+        c.x = (int64_t)floor(x/pEpsilon);
+        c.y = (int64_t)floor(y/pEpsilon);
+        c.z = (int64_t)floor(z/pEpsilon);
+    } else {
+        union { float f; int32_t i; } u;
+        u.f = (x==0.0f) ? 0.0f : x; c.x = u.i; // merge -0.0 and 0.0
+        u.f = (y==0.0f) ? 0.0f : y; c.y = u.i;
+        u.f = (z==0.0f) ? 0.0f : z; c.z = u.i;
+    }
+    return c;
+}
+
+/**
+ Find a point within epsilon in a single cell.
+ 
+ \return the index of the vertex in the mesh, or -1
+ */
+int ISVertexWelder::findPoint(const ISWeldCell &c, float x, float y, float z)
+{
+    ISWeldCellMap::iterator it = pCellHead.find(c);
+    if (it==pCellHead.end())
+        return -1;
+    double e2 = pEpsilon*pEpsilon;
+    int i;
+    for (i=it->second; i!=-1; i=pNext[i]) {
+        ISVec3 &p = pMesh->vertexList[i]->pPosition;
+        if (pEpsilon>0.0) {
+            double dx = p.x()-x, dy = p.y()-y, dz = p.z()-z;
+            if (dx*dx+dy*dy+dz*dz<=e2)
+                return i;
+        } else if (p.x()==x && p.y()==y && p.z()==z) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ Return the index of a vertex at the given position, creating a new vertex
+ if there is none within epsilon yet.
+ 
+ Points are welded greedily: the first point in a cluster becomes the vertex
+ that all later points within epsilon are merged into.
+ */
+int ISVertexWelder::addPoint(float x, float y, float z)
+{
+    ISWeldCell c = cell(x, y, z);
+    int ix = -1;
+    if (pEpsilon>0.0) {
+        ISWeldCell d;
+        for (d.x=c.x-1; d.x<=c.x+1 && ix==-1; d.x++) {
+            for (d.y=c.y-1; d.y<=c.y+1 && ix==-1; d.y++) {
+                for (d.z=c.z-1; d.z<=c.z+1 && ix==-1; d.z++) {
+                    ix = findPoint(d, x, y, z);
+                }
+            }
+        }
+    } else {
+        ix = findPoint(c, x, y, z);
+    }
+    if (ix!=-1)
+        return ix;
+    ix = (int)pMesh->vertexList.size();
+    ISVertex *v = new (pMesh->arena) ISVertex();
+    v->pPosition.set(x, y, z);
+    pMesh->vertexList.push_back(v);
+    link(c, ix);
+    return ix;
+}
+
+/**
+ Add a vertex index to the front of the list of vertices in a cell.
+ */
+void ISVertexWelder::link(const ISWeldCell &c, int ix)
+{
+    if ((int)pNext.size()<=ix)
+        pNext.resize(ix+1, -1);
+    std::pair<ISWeldCellMap::iterator, bool> r = pCellHead.insert(std::make_pair(c, ix));
+    if (r.second) {
+        pNext[ix] = -1;
+    } else {
+        pNext[ix] = r.first->second;
+        r.first->second = ix;
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+ISHalfEdgeMesh::ISHalfEdgeMesh()
+{
+}
+
+void ISHalfEdgeMesh::clear()
+{
+    pX.clear(); pY.clear(); pZ.clear();
+    pNX.clear(); pNY.clear(); pNZ.clear();
+    pFaceNX.clear(); pFaceNY.clear(); pFaceNZ.clear();
+    pHEVertex.clear();
+    pHETwin.clear();
+}
+
+/**
+ Copy the vertices and faces of a pointer based mesh.
+ 
+ Normals are copied as well, so a mesh that was already prepared for
+ slicing does not need to be recalculated.
+ */
+void ISHalfEdgeMesh::set(const ISMesh &m)
+{
+    clear();
+    int i, n = (int)m.vertexList.size();
+    std::unordered_map<const ISVertex*, uint32_t> index;
+    index.reserve(n);
+    pX.reserve(n); pY.reserve(n); pZ.reserve(n);
+    for (i=0; i<n; i++) {
+        ISVertex *v = m.vertexList[i];
+        index[v] = addVertex(v->pPosition.x(), v->pPosition.y(), v->pPosition.z());
+        pNX[i] = v->pNormal.x(); pNY[i] = v->pNormal.y(); pNZ[i] = v->pNormal.z();
+    }
+    n = (int)m.faceList.size();
+    pHEVertex.reserve(3*n);
+    pHETwin.reserve(3*n);
+    for (i=0; i<n; i++) {
+        ISFace *f = m.faceList[i];
+        uint32_t ix = addFace(index[f->pVertex[0]], index[f->pVertex[1]], index[f->pVertex[2]]);
+        pFaceNX[ix] = f->pNormal.x(); pFaceNY[ix] = f->pNormal.y(); pFaceNZ[ix] = f->pNormal.z();
+    }
+    linkHalfEdges();
+}
+
+uint32_t ISHalfEdgeMesh::addVertex(float x, float y, float z)
+{
+    pX.push_back(x); pY.push_back(y); pZ.push_back(z);
+    pNX.push_back(0.0f); pNY.push_back(0.0f); pNZ.push_back(0.0f);
+    return (uint32_t)pX.size()-1;
+}
+
+/**
+ Add a triangle. Call linkHalfEdges() after adding the last face.
+ 
+ \return the index of the new face
+ */
+uint32_t ISHalfEdgeMesh::addFace(uint32_t a, uint32_t b, uint32_t c)
+{
+    pHEVertex.push_back(a);
+    pHEVertex.push_back(b);
+    pHEVertex.push_back(c);
+    pHETwin.push_back(kISNone);
+    pHETwin.push_back(kISNone);
+    pHETwin.push_back(kISNone);
+    pFaceNX.push_back(0.0f); pFaceNY.push_back(0.0f); pFaceNZ.push_back(0.0f);
+    return nFaces()-1;
+}
+
+/**
+ Find the twin of every half-edge that is not linked yet.
+ 
+ The index of open half-edges is only kept while linking, so it does not
+ add to the size of the mesh.
+ */
+void ISHalfEdgeMesh::linkHalfEdges()
+{
+    uint32_t h, n = (uint32_t)pHEVertex.size();
+    std::unordered_map<uint64_t, uint32_t> open;
+    for (h=0; h<n; h++) {
+        if (pHETwin[h]!=kISNone) continue;
+        uint64_t v0 = pHEVertex[h], v1 = pHEVertex[next(h)];
+        std::unordered_map<uint64_t, uint32_t>::iterator it = open.find((v1<<32)|v0);
+        if (it!=open.end()) {
+            pHETwin[h] = it->second;
+            pHETwin[it->second] = h;
+            open.erase(it);
+        } else {
+            open[(v0<<32)|v1] = h;
+        }
+    }
+}
+
+/**
+ Find the border half-edge that continues a hole after half-edge h.
+ 
+ We rotate around the end vertex of h until we find a half-edge without a
+ twin.
+ 
+ \return the next border half-edge, or kISNone for non-manifold borders
+ */
+uint32_t ISHalfEdgeMesh::nextBorder(uint32_t h) const
+{
+    uint32_t g = next(h);
+    int n;
+    for (n=0; n<10000; n++) {
+        if (pHETwin[g]==kISNone)
+            return g;
+        g = next(pHETwin[g]);
+    }
+    return kISNone;
+}
+
+void ISHalfEdgeMesh::clearNormals()
+{
+    std::fill(pNX.begin(), pNX.end(), 0.0f);
+    std::fill(pNY.begin(), pNY.end(), 0.0f);
+    std::fill(pNZ.begin(), pNZ.end(), 0.0f);
+    std::fill(pFaceNX.begin(), pFaceNX.end(), 0.0f);
+    std::fill(pFaceNY.begin(), pFaceNY.end(), 0.0f);
+    std::fill(pFaceNZ.begin(), pFaceNZ.end(), 0.0f);
+}
+
+void ISHalfEdgeMesh::calculateFaceNormals()
+{
+    uint32_t f, n = nFaces();
+    for (f=0; f<n; f++) {
+        uint32_t a = pHEVertex[3*f], b = pHEVertex[3*f+1], c = pHEVertex[3*f+2];
+        ISVec3 p1(pX[b]-pX[a], pY[b]-pY[a], pZ[b]-pZ[a]);
+        ISVec3 p2(pX[c]-pX[a], pY[c]-pY[a], pZ[c]-pZ[a]);
+        p1.cross(p2);
+        p1.normalize();
+        pFaceNX[f] = p1.x(); pFaceNY[f] = p1.y(); pFaceNZ[f] = p1.z();
+    }
+}
+
+/**
+ Average the normals of all faces around a vertex, just like
+ ISMesh::calculateVertexNormals().
+ */
+void ISHalfEdgeMesh::calculateVertexNormals()
+{
+    uint32_t i, n = nVertices();
+    std::vector<int> count(n, 0);
+    std::fill(pNX.begin(), pNX.end(), 0.0f);
+    std::fill(pNY.begin(), pNY.end(), 0.0f);
+    std::fill(pNZ.begin(), pNZ.end(), 0.0f);
+    n = (uint32_t)pHEVertex.size();
+    for (i=0; i<n; i++) {
+        uint32_t v = pHEVertex[i], f = face(i);
+        pNX[v] += pFaceNX[f]; pNY[v] += pFaceNY[f]; pNZ[v] += pFaceNZ[f];
+        count[v]++;
+    }
+    n = nVertices();
+    for (i=0; i<n; i++) {
+        if (count[i]>0) {
+            float len = 1.0f/count[i];
+            pNX[i] *= len; pNY[i] *= len; pNZ[i] *= len;
+        }
+    }
+}
+
+/**
+ Close all holes in the mesh.
+ 
+ Every loop of border half-edges is filled with a fan of triangles
+ around the first vertex of the loop. The new faces run in the opposite
+ direction of the border, so their half-edges become the missing twins.
+ */
+void ISHalfEdgeMesh::fixHoles()
+{
+    uint32_t h, n = (uint32_t)pHEVertex.size();
+    std::vector<bool> visited(n, false);
+    std::vector<uint32_t> loop;
+    int nHoles = 0;
+    for (h=0; h<n; h++) {
+        if (pHETwin[h]!=kISNone || visited[h]) continue;
+        // collect the vertices around the hole
+        loop.clear();
+        uint32_t g = h;
+        while (g!=kISNone && !visited[g]) {
+            visited[g] = true;
+            loop.push_back(pHEVertex[g]);
+            g = nextBorder(g);
+        }
+        if (g!=h) {
+            printf("ERROR: fixHoles - hole %d is not a closed loop!\n", nHoles);
+            continue;
+        }
+        uint32_t i, k = (uint32_t)loop.size();
+        for (i=1; i+1<k; i++) {
+            addFace(loop[0], loop[i+1], loop[i]);
+        }
+        nHoles++;
+    }
+    if (nHoles) {
+        printf("Fixed %d holes\n", nHoles);
+        linkHalfEdges();
+    }
+}
+
+/**
+ Return the number of bytes used by the mesh data.
+ */
+size_t ISHalfEdgeMesh::memoryUsage() const
+{
+    return (pX.capacity() + pY.capacity() + pZ.capacity()
+            + pNX.capacity() + pNY.capacity() + pNZ.capacity()
+            + pFaceNX.capacity() + pFaceNY.capacity() + pFaceNZ.capacity()) * sizeof(float)
+    + (pHEVertex.capacity() + pHETwin.capacity()) * sizeof(uint32_t);
+}
+
+// -----------------------------------------------------------------------------
+
+
+ISMeshSlice::ISMeshSlice()
+:   pStamp(0),
+    pNOpenContours(0),
+    pTess(0L),
+    pTessVertexCount(0)
+{
+}
+
+ISMeshSlice::~ISMeshSlice()
+{
+    clear();
+    if (pTess)
+        gluDeleteTess(pTess);
+}
+
+/**
+ Remove the geometry of the current layer.
+ 
+ All intersection vertices, lid edges and lid faces live in the slice
+ arena. The arena and all lists keep their memory, so that slicing the
+ next layer does not need to go back to the heap.
+ */
+void ISMeshSlice::clear()
+{
+    lidEdgeList.clear();
+    vertexList.clear();
+    edgeList.clear();
+    edgeIndex.reset();
+    faceList.clear();
+    arena.reset();
+    pNOpenContours = 0;
+}
+
+/**
+ Collect the vertices that the GLU tesselator sends us into triangles.
+ 
+ The tesselator is set to report nothing but independent triangles.
+ */
+void ISMeshSlice::tessVertex(ISVertex *v)
+{
+    if (pTessVertexCount<2) {
+        pTessV[pTessVertexCount++] = v;
+    } else {
+        ISFace *f = new (arena) ISFace();
+        f->pVertex[0] = pTessV[0];
+        f->pVertex[1] = pTessV[1];
+        f->pVertex[2] = v;
+        addFace(f);
+        pTessVertexCount = 0;
+    }
+}
+
+static void tessBeginCallback(GLenum which, ISMeshSlice *slice)
+{
+    slice->pTessVertexCount = 0;
+}
+
+static void tessEndCallback(ISMeshSlice *slice)
+{
+}
+
+static void tessVertexCallback(ISVertex *vertex, ISMeshSlice *slice)
+{
+    slice->tessVertex(vertex);
+}
+
+static void tessCombineCallback(GLdouble coords[3],
+                                ISVertex *vertex_data[4],
+                                GLfloat weight[4], ISVertex **dataOut,
+                                ISMeshSlice *slice)
+{
+    ISVertex *v = new (slice->arena) ISVertex();
+    v->pPosition.read(coords);
+    slice->vertexList.push_back(v);
+    *dataOut = v;
+}
+
+static void tessEdgeFlagCallback(GLboolean flag, ISMeshSlice *slice)
+{
+}
+
+static void tessErrorCallback(GLenum errorCode, ISMeshSlice *slice)
+{
+    const GLubyte *estring;
+    estring = gluErrorString(errorCode);
+    fprintf (stderr, "Tessellation Error: %s\n", estring);
+}
+
+/**
+ Fill the lid contours with triangles.
+ 
+ Every slice owns its own tesselator, and all callbacks get the slice as
+ their polygon data, so different slices can be tesselated at the same
+ time.
+ */
+void ISMeshSlice::tesselate()
+{
+    if (!pTess) {
+        pTess = gluNewTess();
+        gluTessCallback(pTess, GLU_TESS_VERTEX_DATA, (GLvoid (*) ()) &tessVertexCallback);
+        gluTessCallback(pTess, GLU_TESS_BEGIN_DATA, (GLvoid (*) ()) &tessBeginCallback);
+        gluTessCallback(pTess, GLU_TESS_END_DATA, (GLvoid (*) ()) &tessEndCallback);
+        gluTessCallback(pTess, GLU_TESS_ERROR_DATA, (GLvoid (*) ()) &tessErrorCallback);
+        gluTessCallback(pTess, GLU_TESS_COMBINE_DATA, (GLvoid (*) ()) &tessCombineCallback);
+        gluTessCallback(pTess, GLU_TESS_EDGE_FLAG_DATA, (GLvoid (*) ()) &tessEdgeFlagCallback);
+        gluTessProperty(pTess, GLU_TESS_WINDING_RULE, GLU_TESS_WINDING_POSITIVE);
+    }
+    
+    int i, n = (int)lidEdgeList.size();
+    pTessVertexCount = 0;
+    gluTessBeginPolygon(pTess, this);
+    gluTessBeginContour(pTess);
+    for (i=0; i<n; i++) {
+        ISEdge *e = lidEdgeList[i];
+        if (e==NULL) {
+            gluTessEndContour(pTess);
+            gluTessBeginContour(pTess);
+        } else {
+            gluTessVertex(pTess, e->pVertex[0]->pPosition.dataPointer(), e->pVertex[0]);
+        }
+    }
+    gluTessEndContour(pTess);
+    gluTessEndPolygon(pTess);
+}
+
+/**
+ Start a new generation of face marks for a mesh of nFaces faces.
+ */
+void ISMeshSlice::nextStamp(size_t nFaces)
+{
+    if (pFaceStamp.size()<nFaces)
+        pFaceStamp.resize(nFaces, 0);
+    if (++pStamp==0) {
+        std::fill(pFaceStamp.begin(), pFaceStamp.end(), 0);
+        pStamp = 1;
+    }
+}
+
+/**
+ Mark a face of the sliced mesh as visited.
+ 
+ The marks live in the slice, not in the mesh, so many slices can walk the
+ same mesh at the same time.
+ 
+ \return false if the face was already visited in this layer
+ */
+bool ISMeshSlice::useFace(uint32_t f)
+{
+    uint32_t &stamp = pFaceStamp[f];
+    if (stamp==pStamp)
+        return false;
+    stamp = pStamp;
+    return true;
+}
+
+
+/*
+ Create the edge that cuts this triangle in half.
+ 
+ The first point is know to be on the z slice. The second edge that crosses
+ z is found and the point of intersection is calculated. Then an edge is
+ created that splits the face on the z plane.
+ 
+ \param isFace the face that is split in two; the face must cross zMin;
+        returns the next face, or NULL if the contour ran into a hole
+ \param vCutA the first point on zMin along the first edge
+ \param edgeIndex the index of the first edge that crosses zMin
+ \param zMin slice on this z plane
+ */
+void ISMeshSlice::addNextLidVertex(ISFacePtr &isFace, ISVertexPtr &vCutA, int &edgeIndex, double zMin)
+{
+    // faces are always clockwise
+    ISVertex *vOpp = isFace->pVertex[(edgeIndex+2)%3];
+    int newIndex;
+    if (vOpp->pPosition.z()<zMin) {
+        newIndex = (edgeIndex+1)%3;
+    } else {
+        newIndex = (edgeIndex+2)%3;
+    }
+    ISEdge *eCutB = isFace->pEdge[newIndex];
+    ISVertex *vCutB = eCutB->findZ(zMin, arena);
+    if (!vCutB) {
+        puts("ERROR: addNextLidVertex failed, no Z point found!");
+    }
+    vertexList.push_back(vCutB);
+    ISEdge *lidEdge = new (arena) ISEdge();
+    lidEdge->pVertex[0] = vCutA;
+    lidEdge->pVertex[1] = vCutB;
+    lidEdgeList.push_back(lidEdge);
+    
+    vCutA = vCutB;
+    isFace = eCutB->otherFace(isFace);
+    if (isFace)
+        edgeIndex = eCutB->indexIn(isFace);
+}
+
+/*
+ Create the edge that cuts this triangle in half.
+ 
+ The first point is know to be on the z slice. The second edge that crosses
+ z is found and the point of intersection is calculated. Then an edge is
+ created that splits the face on the z plane.
+ 
+ \param isFace the face that is split in two; the face must cross zMin
+ \param vCutA the first point on zMin along the first edge
+ \param edgeIndex the index of the first edge that crosses zMin
+ \param zMin slice on this z plane
+ */
+void ISMeshSlice::addFirstLidVertex(ISFace *isFace, double zMin)
+{
+    ISFace *firstFace = isFace;
+    // find first edge that crosses zMin
+    int edgeIndex = -1;
+    if (isFace->pVertex[0]->pPosition.z()<zMin && isFace->pVertex[1]->pPosition.z()>=zMin) edgeIndex = 0;
+    if (isFace->pVertex[1]->pPosition.z()<zMin && isFace->pVertex[2]->pPosition.z()>=zMin) edgeIndex = 1;
+    if (isFace->pVertex[2]->pPosition.z()<zMin && isFace->pVertex[0]->pPosition.z()>=zMin) edgeIndex = 2;
+    if (edgeIndex==-1) {
+        puts("ERROR: addFirstLidVertex failed, not crossing zMin!");
+    }
+    ISVertex *vCutA = isFace->pEdge[edgeIndex]->findZ(zMin, arena);
+    if (!vCutA) {
+        puts("ERROR: addFirstLidVertex failed, no Z point found!");
+    }
+    vertexList.push_back(vCutA);
+    //  addNextLidVertex(isFace, vCutA, edgeIndex, zMin);
+    for (;;) {
+        addNextLidVertex(isFace, vCutA, edgeIndex, zMin);
+        if (!isFace || !useFace(isFace))
+            break;
+    }
+    if (firstFace!=isFace) {
+        // the contour ran into a hole, or into a contour that did
+        pNOpenContours++;
+    }
+    lidEdgeList.push_back(0L);
+}
+
+/**
+ Add the lid contours of a mesh at zMin.
+ 
+ If the z index of the mesh is up to date, only the faces that actually
+ cross zMin are visited. Otherwise we have to check every face.
+ */
+void ISMeshSlice::addZSlice(const ISMesh &m, double zMin)
+{
+    int i, n;
+    crossingFaceList.clear();
+    if (m.zIndex.nFaces()==m.faceList.size()) {
+        m.zIndex.findFaces(zMin, crossingFaceList);
+    } else {
+        n = (int)m.faceList.size();
+        for (i = 0; i < n; i++) {
+            crossingFaceList.push_back(i);
+        }
+    }
+    addZSlice(m, zMin, crossingFaceList);
+}
+
+/**
+ Add the lid contours of a mesh at zMin.
+ 
+ \param crossingFaces indices of all faces in m that cross zMin; other
+        faces may be in the list as well, they are skipped
+ */
+void ISMeshSlice::addZSlice(const ISMesh &m, double zMin, const std::vector<uint32_t> &crossingFaces)
+{
+    int i, n = (int)crossingFaces.size();
+    nextStamp(m.faceList.size());
+    for (i = 0; i < n; i++) {
+        ISFace *isFace = m.faceList[crossingFaces[i]];
+        if (!useFace(isFace)) continue;
+        int nBelow = isFace->pointsBelowZ(zMin);
+        if (nBelow==0) {
+            // do nothing
+        } else if (nBelow==1) {
+            addFirstLidVertex(isFace, zMin);
+        } else if (nBelow==2) {
+            addFirstLidVertex(isFace, zMin);
+        } else if (nBelow==3) {
+            // do nothing
+        }
+    }
+}
+
+/**
+ Find the point where a half-edge crosses zMin.
+ 
+ The edge is taken in the direction of the half-edge of the face that was
+ added first, just like the ISEdge that ISMesh::addFace() creates for it,
+ so that both meshes return exactly the same point.
+ */
+static ISVec3 heFindZ(const ISHalfEdgeMesh &m, uint32_t h, double zMin)
+{
+    uint32_t g = m.twin(h);
+    if (g<h) h = g;
+    uint32_t v0 = m.vertex(h), v1 = m.vertex(ISHalfEdgeMesh::next(h));
+    double x1 = m.pX[v1], y1 = m.pY[v1], z1 = m.pZ[v1];
+    double t = (zMin-z1)/(m.pZ[v0]-z1);
+    ISVec3 p;
+    p.pV[0] = (m.pX[v0]-x1)*t + x1;
+    p.pV[1] = (m.pY[v0]-y1)*t + y1;
+    p.pV[2] = (m.pZ[v0]-z1)*t + z1;
+    return p;
+}
+
+/**
+ Add the lid contours of a compact mesh at zMin.
+ 
+ If the z index of the mesh is up to date, only the faces that actually
+ cross zMin are visited. Otherwise we have to check every face.
+ */
+void ISMeshSlice::addZSlice(const ISHalfEdgeMesh &m, double zMin)
+{
+    uint32_t i, n;
+    crossingFaceList.clear();
+    if (m.zIndex.nFaces()==m.nFaces()) {
+        m.zIndex.findFaces(zMin, crossingFaceList);
+    } else {
+        n = m.nFaces();
+        for (i = 0; i < n; i++) {
+            crossingFaceList.push_back(i);
+        }
+    }
+    addZSlice(m, zMin, crossingFaceList);
+}
+
+/**
+ Add the lid contours of a compact mesh at zMin.
+ 
+ This follows the same path as addZSlice() for ISMesh: find a face that
+ crosses zMin, then walk from face to face across the edges that cross
+ zMin until we are back at the first face. The source mesh is not changed.
+ A contour that runs into a hole, or into a contour that did, is closed
+ where it ends and counted in pNOpenContours, as in addFirstLidVertex().
+ 
+ \param crossingFaces indices of all faces in m that cross zMin; other
+        faces may be in the list as well, they are skipped
+ */
+void ISMeshSlice::addZSlice(const ISHalfEdgeMesh &m, double zMin, const std::vector<uint32_t> &crossingFaces)
+{
+    uint32_t j, n = (uint32_t)crossingFaces.size();
+    nextStamp(m.nFaces());
+    for (j = 0; j < n; j++) {
+        uint32_t f = crossingFaces[j];
+        if (!useFace(f)) continue;
+        int nBelow = (m.pZ[m.pHEVertex[3*f]]<zMin)
+                   + (m.pZ[m.pHEVertex[3*f+1]]<zMin)
+                   + (m.pZ[m.pHEVertex[3*f+2]]<zMin);
+        if (nBelow==0 || nBelow==3)
+            continue;
+        // find the first half-edge that crosses zMin upwards
+        uint32_t h = kISNone, i;
+        for (i=0; i<3; i++) {
+            if (   m.pZ[m.pHEVertex[3*f+i]]<zMin
+                && m.pZ[m.pHEVertex[ISHalfEdgeMesh::next(3*f+i)]]>=zMin)
+                h = 3*f+i;
+        }
+        ISVertex *vCutA = new (arena) ISVertex();
+        vCutA->pPosition = heFindZ(m, h, zMin);
+        vertexList.push_back(vCutA);
+        for (;;) {
+            // faces are always clockwise
+            uint32_t hOpp = ISHalfEdgeMesh::prev(h);
+            uint32_t hOut = (m.pZ[m.pHEVertex[hOpp]]<zMin) ? ISHalfEdgeMesh::next(h) : hOpp;
+            ISVertex *vCutB = new (arena) ISVertex();
+            vCutB->pPosition = heFindZ(m, hOut, zMin);
+            vertexList.push_back(vCutB);
+            ISEdge *lidEdge = new (arena) ISEdge();
+            lidEdge->pVertex[0] = vCutA;
+            lidEdge->pVertex[1] = vCutB;
+            lidEdgeList.push_back(lidEdge);
+            vCutA = vCutB;
+            h = m.twin(hOut);
+            if (h==kISNone || !useFace(ISHalfEdgeMesh::face(h)))
+                break;
+        }
+        if (h==kISNone || ISHalfEdgeMesh::face(h)!=f)
+            pNOpenContours++;
+        lidEdgeList.push_back(0L);
+    }
+}
+
+// -----------------------------------------------------------------------------
+
+ISSlicer::ISSlicer()
+:   pSliceTime(0.0)
+{
+}
+
+void ISSlicer::clear()
+{
+    pMeshList.clear();
+}
+
+/**
+ Add a mesh to the list of meshes that are sliced together.
+ 
+ The faces are sorted here, so the mesh must not change until the slicer
+ is cleared.
+ */
+void ISSlicer::addMesh(const ISMesh *m)
+{
+    pMeshList.push_back(ISSweepMesh());
+    ISSweepMesh &sm = pMeshList.back();
+    sm.mesh = m;
+    sm.heMesh = 0L;
+    uint32_t i, n = (uint32_t)m->faceList.size();
+    std::vector<double> zMin(n);
+    sm.zMax.resize(n);
+    for (i=0; i<n; i++) {
+        ISFace *f = m->faceList[i];
+        double z0 = f->pVertex[0]->pPosition.z();
+        double z1 = f->pVertex[1]->pPosition.z();
+        double z2 = f->pVertex[2]->pPosition.z();
+        zMin[i] = std::min(z0, std::min(z1, z2));
+        sm.zMax[i] = std::max(z0, std::max(z1, z2));
+    }
+    sortFaces(sm, zMin);
+}
+
+/**
+ Add a compact mesh to the list of meshes that are sliced together.
+ */
+void ISSlicer::addMesh(const ISHalfEdgeMesh *m)
+{
+    pMeshList.push_back(ISSweepMesh());
+    ISSweepMesh &sm = pMeshList.back();
+    sm.mesh = 0L;
+    sm.heMesh = m;
+    uint32_t i, n = m->nFaces();
+    std::vector<double> zMin(n);
+    sm.zMax.resize(n);
+    for (i=0; i<n; i++) {
+        double z0 = m->pZ[m->pHEVertex[3*i]];
+        double z1 = m->pZ[m->pHEVertex[3*i+1]];
+        double z2 = m->pZ[m->pHEVertex[3*i+2]];
+        zMin[i] = std::min(z0, std::min(z1, z2));
+        sm.zMax[i] = std::max(z0, std::max(z1, z2));
+    }
+    sortFaces(sm, zMin);
+}
+
+/**
+ Sort the faces of a mesh by their lowest z for the sweep.
+ */
+void ISSlicer::sortFaces(ISSweepMesh &sm, const std::vector<double> &zMin)
+{
+    uint32_t i, n = (uint32_t)zMin.size();
+    sm.byZMin.resize(n);
+    for (i=0; i<n; i++) {
+        sm.byZMin[i] = i;
+    }
+    std::sort(sm.byZMin.begin(), sm.byZMin.end(), ISZLess(zMin));
+    sm.zMinSorted.resize(n);
+    for (i=0; i<n; i++) {
+        sm.zMinSorted[i] = zMin[sm.byZMin[i]];
+    }
+}
+
+/**
+ Return the number of layers from firstZ up to and including lastZ.
+ */
+int ISSlicer::nLayers(double firstZ, double lastZ, double layerHeight)
+{
+    if (lastZ<firstZ || layerHeight<=0.0)
+        return 0;
+    return (int)floor((lastZ-firstZ)/layerHeight + 1e-6) + 1;
+}
+
+/**
+ Slice all meshes from firstZ up to lastZ.
+ 
+ For every layer, the slice is cleared and filled with the lid contours of
+ all meshes at that height. Then the callback is called with the slice. The
+ slice is not tesselated here.
+ 
+ \return the number of layers
+ */
+int ISSlicer::sweep(ISMeshSlice &slice, double firstZ, double lastZ, double layerHeight,
+                    ISSliceCallback *cb, void *userData)
+{
+    int layer, n = nLayers(firstZ, lastZ, layerHeight);
+    int i, nMesh = (int)pMeshList.size();
+    std::vector<size_t> next(nMesh, 0);
+    for (i=0; i<nMesh; i++) {
+        pMeshList[i].active.clear();
+    }
+    for (layer=0; layer<n; layer++) {
+        double z = firstZ + layer*layerHeight;
+        slice.clear();
+        for (i=0; i<nMesh; i++) {
+            ISSweepMesh &sm = pMeshList[i];
+            // add all faces that start below the plane
+            size_t nf = sm.byZMin.size();
+            while (next[i]<nf && sm.zMinSorted[next[i]]<z) {
+                sm.active.push_back(sm.byZMin[next[i]]);
+                next[i]++;
+            }
+            // remove all faces that end below the plane
+            size_t j, k = 0;
+            for (j=0; j<sm.active.size(); j++) {
+                uint32_t f = sm.active[j];
+                if (sm.zMax[f]>=z)
+                    sm.active[k++] = f;
+            }
+            sm.active.resize(k);
+            if (sm.heMesh)
+                slice.addZSlice(*sm.heMesh, z, sm.active);
+            else
+                slice.addZSlice(*sm.mesh, z, sm.active);
+        }
+        if (cb)
+            (*cb)(slice, layer, z, userData);
+    }
+    return n;
+}
+
+/**
+ Shared state of all threads in ISSlicer::sliceParallel().
+ 
+ Layers are handed out one at a time in z order. A thread that is done with
+ a layer simply takes the next one, so threads that get small layers just
+ take more of them. Finished layers wait in a ring of slices until all
+ layers below them have been passed on.
+ */
+struct ISParallelSlice
+{
+    ISSlicer *slicer;
+    double firstZ, layerHeight;
+    int nLayers, nSlots;
+    ISSliceCallback *work;
+    void *userData;
+    std::vector<ISMeshSlice*> slot;
+    std::vector<char> ready;
+    int nextLayer, nextDone;
+    std::mutex mutex;
+    std::condition_variable cond;
+};
+
+static void sliceParallelThread(ISParallelSlice *ps)
+{
+    for (;;) {
+        int layer;
+        {
+            std::unique_lock<std::mutex> lock(ps->mutex);
+            if (ps->nextLayer>=ps->nLayers)
+                return;
+            layer = ps->nextLayer++;
+            // wait until the slot for this layer was passed on
+            while (layer>=ps->nextDone+ps->nSlots)
+                ps->cond.wait(lock);
+        }
+        ISMeshSlice &slice = *ps->slot[layer%ps->nSlots];
+        double z = ps->firstZ + layer*ps->layerHeight;
+        double t0 = isTime();
+        slice.clear();
+        slice.layerData.clear();
+        int i, n = (int)ps->slicer->pMeshList.size();
+        for (i=0; i<n; i++) {
+            const ISSweepMesh &sm = ps->slicer->pMeshList[i];
+            if (sm.heMesh)
+                slice.addZSlice(*sm.heMesh, z);
+            else
+                slice.addZSlice(*sm.mesh, z);
+        }
+        double dt = isTime()-t0;
+        if (ps->work)
+            (*ps->work)(slice, layer, z, ps->userData);
+        {
+            std::unique_lock<std::mutex> lock(ps->mutex);
+            ps->ready[layer%ps->nSlots] = 1;
+            ps->slicer->pSliceTime += dt;
+        }
+        ps->cond.notify_all();
+    }
+}
+
+/**
+ Slice all meshes from firstZ up to lastZ on many threads.
+ 
+ Every layer is sliced on its own through the z index of the meshes. Then
+ the work callback is called for the layer on the same thread, so it
+ should only touch the slice and its layerData. The done callback is
+ called on the calling thread for one layer after the other in z order.
+ The time spent slicing, summed over all threads, is added to pSliceTime.
+ 
+ \param work called on any thread, may be NULL
+ \param done called in z order on the calling thread, may be NULL
+ \param nThreads number of threads, 0 to use all cores
+ \return the number of layers
+ */
+int ISSlicer::sliceParallel(double firstZ, double lastZ, double layerHeight,
+                            ISSliceCallback *work, ISSliceCallback *done,
+                            void *userData, int nThreads)
+{
+    int i, layer, n = nLayers(firstZ, lastZ, layerHeight);
+    if (nThreads<1) nThreads = (int)std::thread::hardware_concurrency();
+    if (nThreads<1) nThreads = 1;
+    
+    ISParallelSlice ps;
+    ps.slicer = this;
+    ps.firstZ = firstZ;
+    ps.layerHeight = layerHeight;
+    ps.nLayers = n;
+    ps.nSlots = 2*nThreads;
+    ps.work = work;
+    ps.userData = userData;
+    ps.nextLayer = 0;
+    ps.nextDone = 0;
+    for (i=0; i<ps.nSlots; i++) {
+        ps.slot.push_back(new ISMeshSlice());
+    }
+    ps.ready.resize(ps.nSlots, 0);
+    
+    std::vector<std::thread> threads;
+    for (i=0; i<nThreads; i++) {
+        threads.push_back(std::thread(sliceParallelThread, &ps));
+    }
+    for (layer=0; layer<n; layer++) {
+        int s = layer%ps.nSlots;
+        {
+            std::unique_lock<std::mutex> lock(ps.mutex);
+            while (!ps.ready[s])
+                ps.cond.wait(lock);
+        }
+        if (done)
+            (*done)(*ps.slot[s], layer, firstZ + layer*layerHeight, userData);
+        {
+            std::unique_lock<std::mutex> lock(ps.mutex);
+            ps.ready[s] = 0;
+            ps.nextDone++;
+        }
+        ps.cond.notify_all();
+    }
+    for (i=0; i<(int)threads.size(); i++) {
+        threads[i].join();
+    }
+    for (i=0; i<ps.nSlots; i++) {
+        delete ps.slot[i];
+    }
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+
+IS3dpFile::IS3dpFile()
+:   pBytes(0),
+    pFile(0L),
+    pFill(0),
+    pError(false),
+    pFlushPending(false),
+    pQuit(false)
+{
+}
+
+IS3dpFile::~IS3dpFile()
+{
+    close();
+}
+
+/**
+ Create a .3dp file.
+ 
+ \param filename path of the new file
+ \param backgroundFlush write full buffers on a thread of their own
+ \param bufferSize number of bytes collected before they are written
+ \return false if the file could not be created
+ */
+bool IS3dpFile::open(const char *filename, bool backgroundFlush, size_t bufferSize)
+{
+    close();
+    pFile = fopen(filename, "wb");
+    if (!pFile) {
+        fprintf(stderr, "ERROR: can't create %s\n", filename);
+        return false;
+    }
+    // we do our own buffering
+    setvbuf(pFile, 0L, _IONBF, 0);
+    pBuffer.resize(bufferSize<16 ? 16 : bufferSize);
+    pFill = 0;
+    pBytes = 0;
+    pError = false;
+    pFlushPending = false;
+    pQuit = false;
+    if (backgroundFlush) {
+        pFlushBuffer.resize(pBuffer.size());
+        pThread = std::thread(&IS3dpFile::flushThread, this);
+    }
+    return true;
+}
+
+/**
+ Append a number in the variable length format.
+ 
+ Writing to a file that is not open only sets the error flag.
+ */
+void IS3dpFile::writeInt(int32_t x)
+{
+    if (!pFile) {
+        pError = true;
+        return;
+    }
+    if (pFill+5>pBuffer.size())
+        flush();
+    unsigned char *end = encodeInt(&pBuffer[pFill], x);
+    size_t n = end-&pBuffer[pFill];
+    pFill += n;
+    pBytes += n;
+}
+
+/**
+ Append a number in the variable length format, always using five bytes.
+ 
+ Leading bytes of 0x80 add nothing to the value, so any reader can decode
+ the number, and it can be found at a fixed position in a table.
+ */
+void IS3dpFile::writeFixedInt(int32_t x)
+{
+    unsigned char buf[5];
+    buf[0] = ((x>>28) & 0x7f) | 0x80;
+    buf[1] = ((x>>21) & 0x7f) | 0x80;
+    buf[2] = ((x>>14) & 0x7f) | 0x80;
+    buf[3] = ((x>>7) & 0x7f) | 0x80;
+    buf[4] = x & 0x7f;
+    write(buf, 5);
+}
+
+/**
+ Append a block of bytes, for example an encoded layer.
+ 
+ Writing to a file that is not open only sets the error flag.
+ */
+void IS3dpFile::write(const void *data, size_t size)
+{
+    if (!pFile) {
+        pError = true;
+        return;
+    }
+    const unsigned char *src = (const unsigned char*)data;
+    pBytes += size;
+    while (size) {
+        size_t n = std::min(size, pBuffer.size()-pFill);
+        memcpy(&pBuffer[pFill], src, n);
+        pFill += n;
+        src += n;
+        size -= n;
+        if (pFill==pBuffer.size())
+            flush();
+    }
+}
+
+/**
+ Hand the buffer to the flush thread, or write it right away.
+ */
+void IS3dpFile::flush()
+{
+    if (pFill==0) return;
+    if (pThread.joinable()) {
+        size_t size = pBuffer.size();
+        std::unique_lock<std::mutex> lock(pMutex);
+        while (pFlushPending)
+            pCond.wait(lock);
+        pBuffer.swap(pFlushBuffer);
+        pFlushBuffer.resize(pFill);
+        pBuffer.resize(size);
+        pFlushPending = true;
+        pCond.notify_all();
+    } else {
+        if (fwrite(&pBuffer[0], 1, pFill, pFile)!=pFill)
+            pError = true;
+    }
+    pFill = 0;
+}
+
+/**
+ Write buffers as they are handed over until the file is closed.
+ */
+void IS3dpFile::flushThread()
+{
+    std::unique_lock<std::mutex> lock(pMutex);
+    for (;;) {
+        while (!pFlushPending && !pQuit)
+            pCond.wait(lock);
+        if (!pFlushPending)
+            break;
+        lock.unlock();
+        bool ok = (fwrite(&pFlushBuffer[0], 1, pFlushBuffer.size(), pFile)==pFlushBuffer.size());
+        lock.lock();
+        if (!ok)
+            pError = true;
+        pFlushPending = false;
+        pCond.notify_all();
+    }
+}
+
+/**
+ Write what is left in the buffer and close the file.
+ 
+ \return 0, or -1 if anything could not be written
+ */
+int IS3dpFile::close()
+{
+    if (!pFile) return pError ? -1 : 0;
+    flush();
+    if (pThread.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(pMutex);
+            pQuit = true;
+            pCond.notify_all();
+        }
+        pThread.join();
+    }
+    if (fclose(pFile)!=0)
+        pError = true;
+    pFile = 0L;
+    return pError ? -1 : 0;
+}
+
+// -----------------------------------------------------------------------------
+
+/**
+ Shared state of the callbacks in write3dp().
+ */
+struct IS3dpWriter
+{
+    IS3dpFile file;
+    std::vector<uint32_t> layerOffset;
+    int layerHeight;
+    ISSliceCallback *progress;
+    void *userData;
+    ISWriteStats stats;
+    std::mutex mutex;
+};
+
+/**
+ Rasterize and encode a layer; called on any of the slicing threads.
+ */
+static void encode3dpLayerCB(ISMeshSlice &slice, int layer, double z, void *data)
+{
+    IS3dpWriter *w = (IS3dpWriter*)data;
+    double t0 = isTime();
+    slice.bitmap.setup(gLayerX, gLayerY, gLayerW, gLayerH, gIotaXDpi, gIotaYDpi);
+    slice.bitmap.rasterize(slice.lidEdgeList);
+    double t1 = isTime();
+    // spread powder
+    writeInt(slice.layerData, 158);
+    writeInt(slice.layerData, w->layerHeight);
+    writeLayerSwaths(slice.layerData, slice.bitmap, kNDrops, 4);
+    double t2 = isTime();
+    std::unique_lock<std::mutex> lock(w->mutex);
+    w->stats.rasterize += t1-t0;
+    w->stats.encode += t2-t1;
+    w->stats.openContours += slice.pNOpenContours;
+}
+
+/**
+ Write an encoded layer; called in z order on the calling thread.
+ */
+static void write3dpLayerCB(ISMeshSlice &slice, int layer, double z, void *data)
+{
+    IS3dpWriter *w = (IS3dpWriter*)data;
+    double t0 = isTime();
+    w->layerOffset.push_back((uint32_t)w->file.pBytes);
+    w->file.write(slice.layerData.data(), slice.layerData.size());
+    w->stats.write += isTime()-t0;
+    if (w->progress)
+        (*w->progress)(slice, layer, z, w->userData);
+}
+
+/**
+ Slice all meshes of a slicer and write the layers into a .3dp file.
+ 
+ Version 3 files end in a layer index, so that a printer can start at any
+ layer without reading the layers before it:
+ 
+   131 n offset[0] dz[0] ... offset[n-1] dz[n-1] indexOffset
+ 
+ All numbers after 131 take exactly five bytes. offset[i] is the file
+ position of the spread command (158) that starts layer i+1, and dz[i] is
+ the sum of all spreads before it in 1/100 mm, which is how far the build
+ piston went down. indexOffset is the position of the 131 itself, so the
+ index is found by reading the last five bytes of the file. Version 2 had
+ the same index without dz.
+ 
+ \param filename path of the new file
+ \param progress called in z order on the calling thread after a layer was
+        written, may be NULL
+ \param nThreads number of slicing threads, 0 to use all cores
+ \param stats if not NULL, receives the time spent in every phase
+ \return the number of layers written, or -1 if the file could not be
+        created or written
+ */
+int write3dp(const char *filename, ISSlicer &slicer,
+             double firstZ, double lastZ, double layerHeight,
+             ISSliceCallback *progress, void *userData,
+             int nThreads, ISWriteStats *stats)
+{
+    IS3dpWriter w;
+    if (!w.file.open(filename, true))
+        return -1;
+    w.layerHeight = (int)(layerHeight*100.0+0.5); // in 1/100 mm
+    w.progress = progress;
+    w.userData = userData;
+    memset(&w.stats, 0, sizeof(w.stats));
+    // header
+    w.file.writeInt(23);  // Magic
+    w.file.writeInt(3);
+    w.file.writeInt(2013);
+    w.file.writeInt(3);   // File Version
+    w.file.writeInt(159); // total number of layers
+    w.file.writeInt(ISSlicer::nLayers(firstZ, lastZ, layerHeight));
+    
+    slicer.pSliceTime = 0.0;
+    int n = slicer.sliceParallel(firstZ, lastZ, layerHeight,
+                                 encode3dpLayerCB, write3dpLayerCB, &w, nThreads);
+    double t0 = isTime();
+    // layer index
+    uint32_t indexOffset = (uint32_t)w.file.pBytes;
+    w.file.writeInt(131);
+    w.file.writeFixedInt((int32_t)w.layerOffset.size());
+    int i;
+    for (i=0; i<(int)w.layerOffset.size(); i++) {
+        w.file.writeFixedInt((int32_t)w.layerOffset[i]);
+        w.file.writeFixedInt(i*w.layerHeight);
+    }
+    w.file.writeFixedInt((int32_t)indexOffset);
+    if (w.file.close()<0) {
+        fprintf(stderr, "ERROR: can't write %s\n", filename);
+        n = -1;
+    }
+    w.stats.write += isTime()-t0;
+    w.stats.bytes = w.file.pBytes;
+    w.stats.slice = slicer.pSliceTime;
+    if (stats)
+        *stats = w.stats;
+    return n;
+}
+
+// -----------------------------------------------------------------------------
+
+/**
+ Transpose a 32x32 bit matrix in place.
+ 
+ On return, bit j of a[c] is what bit c of a[j] was. The matrix is split
+ into four quarters, and the two off-diagonal quarters are swapped; this is
+ repeated with 16, 8, 4, 2 and 1 bit wide blocks.
+ */
+static void transposeBlock(uint32_t *a)
+{
+    int j, k;
+    uint32_t m = 0x0000ffff;
+    for (j=16; j; j>>=1, m^=m<<j) {
+        for (k=0; k<32; k=(k+j+1)&~j) {
+            uint32_t t = ((a[k]>>j)^a[k+j])&m;
+            a[k] ^= t<<j;
+            a[k+j] ^= t;
+        }
+    }
+}
+
+/**
+ Copy a range of columns of a transposed block into the column words.
+ */
+static void storeBlock(const uint32_t *a, int n, uint32_t *cols, size_t colStride)
+{
+    int c;
+    for (c=0; c<n; c++) {
+        *cols = a[c];
+        cols += colStride;
+    }
+}
+
+/**
+ Turn rows of pixels into columns of pixels, one 32x32 block at a time.
+ 
+ This is the portable version of transposeBits().
+ */
+void transposeBitsScalar(const uint32_t *rows, size_t rowStride, int nRows,
+                         uint32_t *cols, size_t colStride, int nCols)
+{
+    uint32_t a[32];
+    int w, j;
+    for (w=0; w*32<nCols; w++) {
+        for (j=0; j<32; j++) {
+            a[j] = (j<nRows) ? rows[j*rowStride+w] : 0;
+        }
+        transposeBlock(a);
+        storeBlock(a, std::min(32, nCols-w*32), cols+w*32*colStride, colStride);
+    }
+}
+
+/**
+ Turn rows of pixels into columns of pixels.
+ 
+ Row j starts at rows[j*rowStride], with the leftmost pixel in the lowest
+ bit of each word. Column c is written to cols[c*colStride], with row j in
+ bit j. Rows from nRows up to 32 are taken as empty, so a swath of 12 or
+ 16 nozzles ends up in the low bits of the column words.
+ 
+ With SSE2, four blocks of 32 columns that are next to each other are
+ transposed at once, one block per 32 bit lane.
+ 
+ \param nRows number of rows, 1 to 32
+ \param nCols number of columns
+ */
+void transposeBits(const uint32_t *rows, size_t rowStride, int nRows,
+                   uint32_t *cols, size_t colStride, int nCols)
+{
+#ifdef __SSE2__
+    __m128i a[32];
+    uint32_t lane[4][32];
+    int w, j, k, q;
+    for (w=0; w*32+128<=nCols; w+=4) {
+        for (j=0; j<32; j++) {
+            a[j] = (j<nRows) ? _mm_loadu_si128((const __m128i*)(rows+j*rowStride+w)) : _mm_setzero_si128();
+        }
+        uint32_t m = 0x0000ffff;
+        for (j=16; j; j>>=1, m^=m<<j) {
+            __m128i mv = _mm_set1_epi32((int)m), jv = _mm_cvtsi32_si128(j);
+            for (k=0; k<32; k=(k+j+1)&~j) {
+                __m128i t = _mm_and_si128(_mm_xor_si128(_mm_srl_epi32(a[k], jv), a[k+j]), mv);
+                a[k] = _mm_xor_si128(a[k], _mm_sll_epi32(t, jv));
+                a[k+j] = _mm_xor_si128(a[k+j], t);
+            }
+        }
+        for (j=0; j<32; j++) {
+            uint32_t v[4];
+            _mm_storeu_si128((__m128i*)v, a[j]);
+            for (q=0; q<4; q++) lane[q][j] = v[q];
+        }
+        for (q=0; q<4; q++) {
+            storeBlock(lane[q], 32, cols+(w+q)*32*colStride, colStride);
+        }
+    }
+    if (w*32<nCols) {
+        transposeBitsScalar(rows+w, rowStride, nRows, cols+w*32*colStride, colStride, nCols-w*32);
+    }
+#else
+    transposeBitsScalar(rows, rowStride, nRows, cols, colStride, nCols);
+#endif
+}
+
+// -----------------------------------------------------------------------------
+
+ISLayerBitmap::ISLayerBitmap()
+:   pX(0.0),
+    pY(0.0),
+    pXScale(1.0),
+    pYScale(1.0),
+    pWidth(0),
+    pHeight(0),
+    pWordsPerColumn(0),
+    pWordsPerRow(0),
+    pBandWord(-1)
+{
+}
+
+/**
+ Set the area that the bitmap covers and clear all pixels.
+ 
+ \param x, y lower left corner of the bitmap in mm
+ \param w, h size of the bitmap in pixels
+ \param xDpi, yDpi resolution in dots per inch
+ */
+void ISLayerBitmap::setup(double x, double y, int w, int h, double xDpi, double yDpi)
+{
+    pX = x;
+    pY = y;
+    pXScale = xDpi/25.4;
+    pYScale = yDpi/25.4;
+    pWidth = w;
+    pHeight = h;
+    pWordsPerColumn = (h+31)/32;
+    pBits.resize((size_t)pWordsPerColumn*w);
+    pWordsPerRow = (w+31)/32;
+    pBand.resize((size_t)pWordsPerRow*32);
+    clear();
+}
+
+void ISLayerBitmap::clear()
+{
+    std::fill(pBits.begin(), pBits.end(), 0);
+    std::fill(pBand.begin(), pBand.end(), 0);
+    pBandWord = -1;
+}
+
+/**
+ Set the pixels x0 up to, but not including, x1 in row y.
+ 
+ The span goes into the band of 32 rows that holds row y. Starting a
+ different band flushes the current one, so a band must be complete before
+ the next one is started, and flushBand() must be called after the last
+ span.
+ */
+void ISLayerBitmap::fillSpan(int y, int x0, int x1)
+{
+    if (x0<0) x0 = 0;
+    if (x1>pWidth) x1 = pWidth;
+    if (x0>=x1) return;
+    int b = pHeight-1-y;
+    if ((b>>5)!=pBandWord) {
+        flushBand();
+        pBandWord = b>>5;
+    }
+    uint32_t *row = &pBand[(size_t)(b&31)*pWordsPerRow];
+    int w0 = x0>>5, w1 = (x1-1)>>5;
+    uint32_t m0 = 0xffffffffU<<(x0&31), m1 = 0xffffffffU>>(31-((x1-1)&31));
+    if (w0==w1) {
+        row[w0] |= m0&m1;
+    } else {
+        row[w0] |= m0;
+        int w;
+        for (w=w0+1; w<w1; w++) row[w] = 0xffffffffU;
+        row[w1] |= m1;
+    }
+}
+
+/**
+ Copy the band of rows into the column words and clear it.
+ */
+void ISLayerBitmap::flushBand()
+{
+    if (pBandWord<0) return;
+    transposeBits(&pBand[0], pWordsPerRow, 32, &pBits[pBandWord], pWordsPerColumn, pWidth);
+    std::fill(pBand.begin(), pBand.end(), 0);
+    pBandWord = -1;
+}
+
+/**
+ Add a contour edge to the edge table.
+ 
+ The edge covers all rows whose center lies in [ya, yb). Horizontal edges
+ and edges outside of the bitmap cover no rows and are dropped.
+ */
+void ISLayerBitmap::addEdge(const ISVec3 &a, const ISVec3 &b)
+{
+    ISRasterEdge e;
+    const ISVec3 *lo = &a, *hi = &b;
+    e.dir = 1;
+    if (b.y()<a.y()) {
+        lo = &b; hi = &a;
+        e.dir = -1;
+    }
+    e.first = (int)ceil((lo->y()-pY)*pYScale-0.5);
+    e.last = (int)ceil((hi->y()-pY)*pYScale-0.5);
+    if (e.first<0) e.first = 0;
+    if (e.last>pHeight) e.last = pHeight;
+    if (e.first>=e.last) return;
+    e.x = lo->x();
+    e.y = lo->y();
+    e.slope = (hi->x()-lo->x())/(hi->y()-lo->y());
+    pEdgeList.push_back(e);
+}
+
+struct ISRasterEdgeFirst {
+    bool operator()(const ISRasterEdge &a, const ISRasterEdge &b) const { return a.first<b.first; }
+};
+
+/**
+ Fill the lid contours of a slice into the bitmap.
+ 
+ Contours are closed polygons through the first vertex of every lid edge,
+ the same polygons that ISMeshSlice::tesselate() fills. The bitmap is
+ filled with an active edge table: edges are sorted by their first row,
+ and for every row only the edges that span it are intersected. A pixel is
+ set if its center has a non-zero winding number.
+ */
+void ISLayerBitmap::rasterize(const ISEdgeList &lidEdgeList)
+{
+    clear();
+    pEdgeList.clear();
+    int i, first = -1, n = (int)lidEdgeList.size();
+    for (i=0; i<=n; i++) {
+        ISEdge *e = (i<n) ? lidEdgeList[i] : 0L;
+        if (e) {
+            if (first==-1) {
+                first = i;
+            } else {
+                addEdge(lidEdgeList[i-1]->pVertex[0]->pPosition, e->pVertex[0]->pPosition);
+            }
+        } else if (first!=-1) {
+            addEdge(lidEdgeList[i-1]->pVertex[0]->pPosition, lidEdgeList[first]->pVertex[0]->pPosition);
+            first = -1;
+        }
+    }
+    std::sort(pEdgeList.begin(), pEdgeList.end(), ISRasterEdgeFirst());
+    
+    pActive.clear();
+    size_t next = 0, nEdge = pEdgeList.size();
+    int y;
+    for (y=0; y<pHeight; y++) {
+        // update the active edge table
+        while (next<nEdge && pEdgeList[next].first<=y) {
+            pActive.push_back((uint32_t)next++);
+        }
+        size_t j, k = 0;
+        for (j=0; j<pActive.size(); j++) {
+            if (pEdgeList[pActive[j]].last>y)
+                pActive[k++] = pActive[j];
+        }
+        pActive.resize(k);
+        if (k==0) {
+            if (next==nEdge) break;
+            continue;
+        }
+        // find and sort all crossings with the center line of this row
+        double yc = pY + (y+0.5)/pYScale;
+        pCrossing.clear();
+        for (j=0; j<k; j++) {
+            const ISRasterEdge &e = pEdgeList[pActive[j]];
+            ISRasterCrossing c;
+            c.x = e.x + (yc-e.y)*e.slope;
+            c.dir = e.dir;
+            pCrossing.push_back(c);
+        }
+        std::sort(pCrossing.begin(), pCrossing.end());
+        // fill all spans with a non-zero winding number
+        int wind = 0;
+        double xStart = 0.0;
+        for (j=0; j<k; j++) {
+            int prev = wind;
+            wind += pCrossing[j].dir;
+            if (prev==0 && wind!=0) {
+                xStart = pCrossing[j].x;
+            } else if (prev!=0 && wind==0) {
+                fillSpan(y, (int)ceil((xStart-pX)*pXScale-0.5),
+                         (int)ceil((pCrossing[j].x-pX)*pXScale-0.5));
+            }
+        }
+    }
+    flushBand();
+}
+
+// -----------------------------------------------------------------------------
+
+/**
+ Copy the corner coordinates of a range of binary STL records.
+ 
+ Every record is 50 bytes long: a face normal, three corners, and a two
+ byte attribute. Only the corners are copied, nine floats per face.
+ */
+static void parseStlRecords(const unsigned char *records, int first, int last, float *coords)
+{
+    int i;
+    for (i=first; i<last; i++) {
+        memcpy(coords+9*i, records+50*i+12, 9*sizeof(float));
+    }
+}
+
+/**
+ Read all triangle corners of a binary STL file into a flat array.
+ 
+ The file is mapped into memory and the fixed size records are split into
+ one chunk per CPU core, which are then parsed in parallel.
+ 
+ \param filename path to the STL file
+ \param coords receives nine floats per face
+ \return the number of faces read, or -1 if the file could not be read
+ */
+int readStlCoordinates(const char *filename, std::vector<float> &coords)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd==-1) {
+        fprintf(stderr, "ERROR openening file!\n");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st)==-1 || st.st_size<84) {
+        fprintf(stderr, "ERROR: file is not a binary STL file!\n");
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    const unsigned char *data = (const unsigned char*)mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data==MAP_FAILED) {
+        fprintf(stderr, "ERROR mapping file!\n");
+        return -1;
+    }
+    
+    uint32_t nFaces;
+    memcpy(&nFaces, data+80, 4);
+    if (nFaces>(size-84)/50) {
+        fprintf(stderr, "WARNING: STL file is truncated, reading %d of %d faces.\n",
+                (int)((size-84)/50), (int)nFaces);
+        nFaces = (uint32_t)((size-84)/50);
+    }
+    coords.resize(9*(size_t)nFaces);
+    
+    int i, n = (int)nFaces, nThreads = (int)std::thread::hardware_concurrency();
+    if (nThreads<1) nThreads = 1;
+    if (n<nThreads*1024) nThreads = 1;
+    std::vector<std::thread> threads;
+    for (i=1; i<nThreads; i++) {
+        threads.push_back(std::thread(parseStlRecords, data+84, (int)((int64_t)n*i/nThreads),
+                                      (int)((int64_t)n*(i+1)/nThreads), coords.data()));
+    }
+    parseStlRecords(data+84, 0, n/nThreads, coords.data());
+    for (i=0; i<(int)threads.size(); i++) {
+        threads[i].join();
+    }
+    
+    munmap((void*)data, size);
+    return n;
+}
+
+/**
+ Load a single node from a binary stl file.
+ 
+ The file is read in two stages. First, all corner coordinates are parsed
+ into a flat array. Then points that are closer than weldEpsilon are merged
+ into a single vertex, which also closes seams between faces that were
+ meant to touch, and the faces are linked into the mesh.
+ */
+void loadStl(const char *filename, double weldEpsilon) {
+    int i, nDegenerate = 0;
+    
+    std::vector<float> coords;
+    int nFaces = readStlCoordinates(filename, coords);
+    if (nFaces<0)
+        return;
+    ISMesh *isMesh = new ISMesh();
+    gMeshList.push_back(isMesh);
+    
+    ISVertexWelder welder(isMesh, weldEpsilon);
+    welder.reserve(nFaces/2+3);
+    std::vector<int> corners(3*(size_t)nFaces);
+    for (i=0; i<3*nFaces; i++) {
+        const float *c = coords.data()+3*i;
+        corners[i] = welder.addPoint(c[0], c[1], c[2]);
+    }
+    
+    isMesh->faceList.reserve(nFaces);
+    isMesh->edgeList.reserve(3*(size_t)nFaces/2);
+    isMesh->edgeIndex.reserve(3*(size_t)nFaces/2);
+    for (i=0; i<nFaces; i++) {
+        int p1 = corners[3*i], p2 = corners[3*i+1], p3 = corners[3*i+2];
+        // add face, unless welding collapsed it
+        if (p1==p2 || p2==p3 || p3==p1) {
+            nDegenerate++;
+        } else {
+            ISFace *isFace = new (isMesh->arena) ISFace();
+            isFace->pVertex[0] = isMesh->vertexList[p1];
+            isFace->pVertex[1] = isMesh->vertexList[p2];
+            isFace->pVertex[2] = isMesh->vertexList[p3];
+            isMesh->addFace(isFace);
+        }
+    }
+    if (nDegenerate)
+        printf("%d degenerate faces removed\n", nDegenerate);
+    
+    isMesh->validate();
+    // TODO: fix zero size holes
+    // TODO: fix degenrate triangles
+    // holes are not fixed here; the slicer closes the contours that run
+    // into one and counts them in ISMeshSlice::pNOpenContours
+    
+    isMesh->clearNormals();
+    isMesh->calculateNormals();
+    isMesh->buildZIndex();
+}
+
+